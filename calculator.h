@@ -0,0 +1,2149 @@
+#pragma once
+#pragma warning(disable: 26812 26495)
+
+// the calculator itself: lexer, parsers, compiled programs and the ways to
+// evaluate them. Everything is inline so that the REPL and the C API library
+// can each compile it into their own binary.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+enum class Associativity {
+    LEFT,
+    RIGHT
+};
+
+struct OperatorPrecedence {
+    int prec;
+    Associativity assoc;
+};
+
+enum TokenType {
+    ADD = 0,
+    SUBTRACT = 1,
+    MULTIPLY = 2,
+    DIVIDE = 3,
+    POWER = 4,
+    NUMBER,
+    IDENTIFIER,
+    ASSIGN,
+    LEFT_PAREN,
+    RIGHT_PAREN,
+    LEFT_BRACKET,
+    RIGHT_BRACKET,
+    COMMA,
+    ILLEGAL_CHARACTER,
+    END_OF_FILE,
+};
+
+inline OperatorPrecedence OperatorMap[] = {
+    OperatorPrecedence { 1, Associativity::LEFT }, // TokenType::ADD
+    OperatorPrecedence { 1, Associativity::LEFT }, // TokenType::SUBTRACT
+    OperatorPrecedence { 2, Associativity::LEFT }, // TokenType::MULTIPLY
+    OperatorPrecedence { 2, Associativity::LEFT }, // TokenType::DIVIDE
+    OperatorPrecedence { 3, Associativity::RIGHT }, // TokenType::POWER
+};
+
+struct Token {
+    std::string_view string;
+    TokenType type;
+};
+
+inline void
+print_token(Token t) {
+    std::string token_type =
+        t.type == TokenType::ADD ? "ADD" :
+        t.type == TokenType::MULTIPLY ? "MULTIPLY" :
+        t.type == TokenType::NUMBER ? "NUMBER" :
+        t.type == TokenType::IDENTIFIER ? "IDENTIFIER" :
+        t.type == TokenType::END_OF_FILE ? "END_OF_FILE" :
+        "ILLEGAL";
+
+    printf("{ '%.*s', %s }\n", (int)t.string.length(), t.string.data(), token_type.c_str());
+}
+
+// the lexer doesn't own the source; it must outlive the lexer and its tokens
+struct Lexer {
+    std::string_view source;
+
+    size_t current_position;
+    size_t end;
+    size_t tokens_read;
+
+    Lexer(std::string_view source) {
+        this->source = source;
+        this->current_position = 0;
+        this->end = source.length();
+        this->tokens_read = 0;
+    }
+
+    Token
+    make_simple_token(TokenType type) {
+        return Token{
+            std::string_view(source.data() + current_position, is_at_end() ? 0 : 1),
+            type
+        };
+    }
+
+    bool is_at_end() {
+        return current_position >= end;
+    }
+
+    char peek() {
+        return is_at_end() ? '\0' : source[current_position];
+    }
+
+    char peek_next() {
+        return current_position + 1 >= end ? '\0' : source[current_position + 1];
+    }
+
+    char read_next() {
+        return is_at_end() ? '\0' : source[current_position++];
+    }
+
+    void skip_whitespace() {
+        for (;;) {
+            char c = peek();
+
+            switch (c) {
+                case '\n':
+                case '\t':
+                case '\r':
+                case ' ': {
+                    read_next();
+                    continue;
+                }
+            }
+
+            break;
+        }
+    }
+
+    Token 
+    number() {
+
+        size_t start = current_position;
+        read_next();
+
+        for (;;) {
+            char c = peek();
+            if (!isdigit(c)) break;
+            else read_next();
+        }
+
+        return Token{ std::string_view(&source[start], ((long long)current_position - start)), TokenType::NUMBER };
+    }
+
+    Token
+    identifier() {
+
+        size_t start = current_position;
+        read_next();
+
+        for (;;) {
+            char c = peek();
+            if (!isalnum(c) && c != '_') break;
+            else read_next();
+        }
+
+        return Token{ std::string_view(&source[start], current_position - start), TokenType::IDENTIFIER };
+    }
+
+    Token next_token() {
+        tokens_read++;
+        skip_whitespace();
+
+        char c = peek();
+
+        Token t;
+
+        if (isdigit(c)) {
+            t = number();
+        } else if (isalpha(c) || c == '_') {
+            t = identifier();
+        } else {
+            switch (c) {
+                case '+' : { t = make_simple_token(TokenType::ADD); read_next(); } break;
+                case '-' : { t = make_simple_token(TokenType::SUBTRACT); read_next(); } break;
+                case '*' : {
+                    if (peek_next() == '*') {
+                        t = Token{
+                            std::string_view(&source[current_position], 2),
+                            TokenType::POWER
+                        };
+                        read_next();
+                    } else {
+                        t = make_simple_token(TokenType::MULTIPLY); 
+                    }
+                    read_next();
+                } break;
+                case '/' : { t = make_simple_token(TokenType::DIVIDE); read_next(); } break;
+                case '(' : { t = make_simple_token(TokenType::LEFT_PAREN); read_next(); } break;
+                case ')' : { t = make_simple_token(TokenType::RIGHT_PAREN); read_next(); } break;
+                case '=' : { t = make_simple_token(TokenType::ASSIGN); read_next(); } break;
+                case '[' : { t = make_simple_token(TokenType::LEFT_BRACKET); read_next(); } break;
+                case ']' : { t = make_simple_token(TokenType::RIGHT_BRACKET); read_next(); } break;
+                case ',' : { t = make_simple_token(TokenType::COMMA); read_next(); } break;
+
+                default: {
+                    t = 
+                        c == '\0' ?
+                            make_simple_token(TokenType::END_OF_FILE) :
+                            make_simple_token(TokenType::ILLEGAL_CHARACTER);
+                    read_next();
+                } break;
+            }
+        }
+
+        return t;
+    }
+};
+
+// token strings point into the whole source, so strtod must not be allowed to
+// read past the end of the token ("2e1" lexes as NUMBER followed by IDENTIFIER)
+inline double
+token_to_number(Token t) {
+    char buffer[64];
+
+    if (t.string.length() >= sizeof(buffer)) {
+        return std::strtod(std::string(t.string).c_str(), nullptr);
+    }
+
+    memcpy(buffer, t.string.data(), t.string.length());
+    buffer[t.string.length()] = '\0';
+
+    return std::strtod(buffer, nullptr);
+}
+
+// bounds on the work a single expression may cause, so that a pathological
+// input fails fast instead of exhausting the stack or holding up a worker.
+// Each level of nesting takes about 150 bytes of stack in Parser in an
+// optimized build and several times that in a debug one, so the default
+// depth stays well inside the 1 MB main thread stack Windows gives. A lag or
+// rolling window keeps that many time steps of history for every series, 8 MB
+// per series at the default.
+struct Limits {
+    size_t max_tokens = SIZE_MAX;
+    size_t max_depth = 1000;
+    size_t max_instructions = SIZE_MAX;
+    size_t max_window = 1 << 20;
+};
+
+// offsets at which the lines of a source start. It is only built when an
+// error has to be located, so sources that parse cleanly never pay for it.
+struct LineIndex {
+    std::vector<size_t> starts;
+    bool built = false;
+
+    void build(std::string_view source) {
+        char const* const begin = source.data();
+        char const* const end = begin + source.length();
+
+        starts.assign(1, 0);
+        for (char const* p = begin; (p = (char const*)memchr(p, '\n', (size_t)(end - p))); ) {
+            p++;
+            starts.push_back((size_t)(p - begin));
+        }
+
+        built = true;
+    }
+
+    // number of the line that contains `offset`, counting from 0
+    size_t line_of(std::string_view source, size_t offset) {
+        if (!built) build(source);
+        return (size_t)(std::upper_bound(starts.begin(), starts.end(), offset) - starts.begin()) - 1;
+    }
+
+    // offset one past the last character of `line`, not counting its line break
+    size_t line_end(std::string_view source, size_t line) const {
+        size_t end = line + 1 < starts.size() ? starts[line + 1] - 1 : source.length();
+        if (end > starts[line] && source[end - 1] == '\r') end--;
+        return end;
+    }
+};
+
+// errors that every engine reports in the same words
+constexpr char undefined_variable_error[] = "Undefined variable: \n";
+constexpr char window_reference_error[] = "Window references need series evaluation: \n";
+
+// a parser error found while recovering: where it is and what it says
+struct Diagnostic {
+    size_t offset;
+    char const* message;
+};
+
+struct Parser {
+
+    Lexer lexer;
+    Token token;
+
+    Limits limits;
+    size_t depth = 0;
+
+    // values and operators computed so far, held to limits.max_instructions
+    // like the instructions of a compiled program
+    size_t instructions = 0;
+
+    LineIndex line_index;
+
+    // when set, errors are collected here and parsing carries on after them
+    std::vector<Diagnostic>* diagnostics = nullptr;
+
+    // looks up the value of an identifier, returns false if it is unknown
+    std::function<bool(std::string_view, double&)> resolve_variable;
+
+    Parser(Lexer l) : lexer(l) {}
+
+    void next_token() {
+        token = lexer.next_token();
+        if (lexer.tokens_read > limits.max_tokens) report_fatal_error("Expression has too many tokens:\n");
+    }
+
+    double parse() {
+        double value = compute_expr(1);
+        expect_end();
+        return value;
+    }
+
+    // parses the whole expression, collecting every error instead of stopping
+    // at the first. Only exceeding a limit ends the parse early.
+    std::vector<Diagnostic> check() {
+        std::vector<Diagnostic> found;
+        diagnostics = &found;
+
+        try {
+            compute_expr(1);
+            expect_end();
+        } catch (ParserException&) {
+        }
+
+        diagnostics = nullptr;
+        return found;
+    }
+
+    // nothing may follow the top-level expression, such as the ')' of `1) + 2`
+    void expect_end() {
+        if (token.type != TokenType::END_OF_FILE) report_error("Unexpected token:\n");
+    }
+
+    void count_instruction() {
+        if (++instructions > limits.max_instructions) report_fatal_error("Expression exceeds the instruction limit:\n");
+    }
+
+    double compute_op(Token t, double lhs, double rhs) {
+        count_instruction();
+
+        switch (t.type) {
+            case TokenType::ADD: return lhs + rhs;
+            case TokenType::SUBTRACT: return lhs - rhs;
+            case TokenType::MULTIPLY: return lhs * rhs;
+            case TokenType::DIVIDE: return lhs / rhs;
+            case TokenType::POWER: return pow(lhs, rhs);
+            default: report_error("Unknown operator:\n");
+        }
+
+        return NAN;
+    }
+
+    // after an error, skips to the next token that can follow an atom, so that
+    // the rest of the expression is parsed as if the atom had been there
+    void synchronize() {
+        while (token.type > TokenType::POWER
+            && token.type != TokenType::RIGHT_PAREN
+            && token.type != TokenType::END_OF_FILE) {
+            next_token();
+        }
+    }
+
+    double compute_atom() {
+        next_token();
+        if (token.type == TokenType::LEFT_PAREN) {
+            double val = compute_expr(1);
+
+            if (token.type != TokenType::RIGHT_PAREN) {
+                report_error("Unmatched '(':\n");
+                synchronize();
+                if (token.type != TokenType::RIGHT_PAREN) return NAN;
+            }
+
+            next_token();
+            return val;
+        }
+
+        if (token.type == TokenType::END_OF_FILE) {
+            report_error("Unexpected end of expression: \n");
+            return NAN;
+        }
+
+        if (token.type == TokenType::IDENTIFIER) {
+            Token name = token;
+            next_token();
+
+            if (token.type == TokenType::LEFT_BRACKET || token.type == TokenType::LEFT_PAREN) {
+                report_error(window_reference_error);
+
+                // skip the whole reference, it cannot be parsed here
+                while (token.type != TokenType::RIGHT_BRACKET && token.type != TokenType::RIGHT_PAREN
+                    && token.type != TokenType::END_OF_FILE) {
+                    next_token();
+                }
+                if (token.type != TokenType::END_OF_FILE) next_token();
+                return NAN;
+            }
+
+            double val;
+            if (!resolve_variable || !resolve_variable(name.string, val)) {
+                Token next = token;
+                token = name;
+                report_error(undefined_variable_error);
+                token = next;
+                return NAN;
+            }
+
+            count_instruction();
+            return val;
+        }
+
+        if (token.type != TokenType::NUMBER) {
+            report_error("Unexpected character: \n");
+            synchronize();
+            return NAN;
+        }
+
+        count_instruction();
+        double val = token_to_number(token);
+        next_token();
+        return val;
+    }
+
+    double compute_expr(int minimum_precedence) {
+        if (++depth > limits.max_depth) report_fatal_error("Expression is nested too deeply:\n");
+
+        auto atom_lhs = compute_atom();
+
+        while (true) {
+            auto cur = token;
+            if ((cur.type > TokenType::POWER || cur.type < TokenType::ADD)
+                || OperatorMap[cur.type].prec < minimum_precedence) {
+
+                if (cur.type == TokenType::ILLEGAL_CHARACTER) {
+                    report_error("Unknown operator:\n");
+                    next_token();
+                    synchronize();
+                    continue;
+                }
+
+                break;
+            }
+
+            auto op_prec = OperatorMap[cur.type];
+
+            auto next_min_prec =
+                op_prec.assoc == Associativity::LEFT ? op_prec.prec + 1 : op_prec.prec;
+
+            auto atom_rhs = compute_expr(next_min_prec);
+            atom_lhs = compute_op(cur, atom_lhs, atom_rhs);
+        }
+
+        depth--;
+        return atom_lhs;
+    }
+
+    // error handling. Returns only while collecting diagnostics.
+    void report_error(char const* err) {
+        size_t offset = (size_t)(token.string.data() - lexer.source.data());
+
+        if (diagnostics) {
+            diagnostics->push_back(Diagnostic{ offset, err });
+            return;
+        }
+
+        throw ParserException(err + show_error_location(offset));
+    }
+
+    // for errors the parser cannot carry on after, even while collecting
+    [[noreturn]] void report_fatal_error(char const* err) {
+        size_t offset = (size_t)(token.string.data() - lexer.source.data());
+
+        if (diagnostics) {
+            diagnostics->push_back(Diagnostic{ offset, err });
+        }
+
+        throw ParserException(err + show_error_location(offset));
+    }
+
+    // append the location of the parser error: the offending line, cut down
+    // to a window around the error if it is long, with a caret under it
+    std::string show_error_location(size_t offset) {
+        static constexpr size_t max_width = 80;
+        static constexpr std::string_view ellipsis = "...";
+
+        std::string_view source = lexer.source;
+
+        size_t line = line_index.line_of(source, offset);
+        size_t begin = line_index.starts[line];
+        size_t end = line_index.line_end(source, line);
+
+        size_t from = begin;
+        size_t to = end;
+        if (to - from > max_width) {
+            from = offset - begin > max_width / 2 ? offset - max_width / 2 : begin;
+            to = std::min(end, from + max_width);
+            from = std::max(begin, std::min(from, to - max_width));
+        }
+
+        char location[64] = "";
+        if (line_index.starts.size() > 1) {
+            snprintf(location, sizeof(location), "line %zu, column %zu:\n", line + 1, offset - begin + 1);
+        }
+
+        size_t lead = from > begin ? ellipsis.length() : 0;
+        size_t trail = to < end ? ellipsis.length() : 0;
+        size_t caret = lead + (offset - from);
+
+        std::string error_str;
+        error_str.reserve(strlen(location) + lead + (to - from) + trail + 1 + caret + 1);
+
+        error_str += location;
+        error_str.append(ellipsis.data(), lead);
+        error_str.append(source.substr(from, to - from));
+        error_str.append(ellipsis.data(), trail);
+        error_str += '\n';
+        error_str.append(caret, ' ');
+        error_str += '^';
+
+        return error_str;
+    }
+
+    struct ParserException : public std::exception {
+
+        std::string error;
+
+        ParserException(std::string err) : error(err) {
+        }
+
+        const char* what() const throw() {
+            return error.c_str();
+        }
+    };
+};
+
+// computes an expression in reverse Polish notation directly, the way Parser
+// does for infix: one scan with a value stack and no precedence to resolve
+struct RpnParser : Parser {
+
+    static constexpr size_t inline_depth = 32;
+
+    double inline_stack[inline_depth];
+    std::vector<double> heap_stack;
+
+    using Parser::Parser;
+
+    // collects every error like Parser::check, skipping operators that are
+    // missing an operand
+    std::vector<Diagnostic> check() {
+        std::vector<Diagnostic> found;
+        diagnostics = &found;
+
+        try {
+            parse();
+        } catch (ParserException&) {
+        }
+
+        diagnostics = nullptr;
+        return found;
+    }
+
+    double parse() {
+        double* stack = inline_stack;
+        size_t capacity = inline_depth;
+        size_t top = 0;
+
+        next_token();
+        while (token.type != TokenType::END_OF_FILE) {
+            if (token.type >= TokenType::ADD && token.type <= TokenType::POWER) {
+                if (top < 2) {
+                    report_error("Missing operand:\n");
+                    next_token();
+                    continue;
+                }
+
+                top--;
+                stack[top - 1] = compute_op(token, stack[top - 1], stack[top]);
+                next_token();
+                continue;
+            }
+
+            count_instruction();
+            if (top >= limits.max_depth) report_fatal_error("Expression is nested too deeply:\n");
+
+            if (top == capacity) {
+                if (stack == inline_stack) heap_stack.assign(stack, stack + top);
+                heap_stack.resize(capacity * 2);
+                stack = heap_stack.data();
+                capacity *= 2;
+            }
+
+            if (token.type == TokenType::IDENTIFIER) {
+                Token name = token;
+                next_token();
+
+                // `x[t-1]` and `sum(x, 3)` are single operands, as --emit-rpn writes them
+                if (token.type == TokenType::LEFT_BRACKET || token.type == TokenType::LEFT_PAREN) {
+                    report_error(window_reference_error);
+
+                    while (token.type != TokenType::RIGHT_BRACKET && token.type != TokenType::RIGHT_PAREN
+                        && token.type != TokenType::END_OF_FILE) {
+                        next_token();
+                    }
+                    if (token.type != TokenType::END_OF_FILE) next_token();
+                    stack[top++] = NAN;
+                    continue;
+                }
+
+                if (!resolve_variable || !resolve_variable(name.string, stack[top])) {
+                    Token next = token;
+                    token = name;
+                    report_error(undefined_variable_error);
+                    token = next;
+                }
+
+                top++;
+                continue;
+            } else if (token.type == TokenType::NUMBER) {
+                stack[top] = token_to_number(token);
+            } else {
+                report_error("Unexpected character: \n");
+            }
+
+            top++;
+            next_token();
+        }
+
+        if (top == 0) {
+            report_error("Unexpected end of expression: \n");
+            return NAN;
+        }
+        if (top > 1) report_error("Missing operator:\n");
+
+        return stack[0];
+    }
+};
+
+struct EvaluationException : public std::exception {
+
+    std::string error;
+
+    EvaluationException(std::string err) : error(err) {
+    }
+
+    const char* what() const throw() {
+        return error.c_str();
+    }
+};
+
+// binary opcodes share their values with TokenType::ADD .. TokenType::POWER
+enum class OpCode : uint8_t {
+    ADD = 0,
+    SUBTRACT = 1,
+    MULTIPLY = 2,
+    DIVIDE = 3,
+    POWER = 4,
+    PUSH_CONSTANT,
+    LOAD_VARIABLE,
+    LOAD_LAG,
+    ROLLING_SUM,
+    ROLLING_MEAN,
+};
+
+struct Instruction {
+    OpCode op;
+    uint32_t operand;
+};
+
+// the variable and number of time steps named by `x[t-3]` (LOAD_LAG) or
+// `sum(x, 3)` (ROLLING_SUM, ROLLING_MEAN)
+struct Window {
+    uint32_t slot;
+    uint32_t length;
+};
+
+// a range of source bytes, [begin, end)
+struct SourceSpan {
+    size_t begin;
+    size_t end;
+};
+
+// an expression compiled to postfix order, evaluated with a value stack
+struct Program {
+    std::vector<Instruction> code;
+    std::vector<double> constants;
+    std::vector<Window> windows;
+};
+
+inline size_t
+stack_depth(Program const& program) {
+    size_t depth = 0;
+    size_t max_depth = 0;
+
+    for (auto const& instruction : program.code) {
+        if (instruction.op <= OpCode::POWER) {
+            depth--;
+        } else {
+            depth++;
+            max_depth = depth > max_depth ? depth : max_depth;
+        }
+    }
+
+    return max_depth;
+}
+
+inline double
+apply_binary(OpCode op, double lhs, double rhs) {
+    switch (op) {
+        case OpCode::ADD: return lhs + rhs;
+        case OpCode::SUBTRACT: return lhs - rhs;
+        case OpCode::MULTIPLY: return lhs * rhs;
+        case OpCode::DIVIDE: return lhs / rhs;
+        case OpCode::POWER: return pow(lhs, rhs);
+        default: throw EvaluationException("Not a binary operator");
+    }
+}
+
+// a program evaluation that can be stopped after a number of instructions
+// and resumed later, so one long evaluation doesn't have to hold up others
+struct Execution {
+
+    // typical expressions fit in the inline stack and evaluate without
+    // touching the heap
+    static constexpr size_t inline_depth = 32;
+
+    Program const& program;
+    size_t pc = 0;
+
+    double* stack;
+    size_t top = 0;
+    double inline_stack[inline_depth];
+    std::vector<double> heap_stack;
+
+    Execution(Program const& p) : program(p) {
+        size_t depth = stack_depth(program);
+
+        if (depth > inline_depth) {
+            heap_stack.resize(depth);
+            stack = heap_stack.data();
+        } else {
+            stack = inline_stack;
+        }
+    }
+
+    Execution(Execution const&) = delete;
+    Execution& operator=(Execution const&) = delete;
+
+    bool finished() const {
+        return pc == program.code.size();
+    }
+
+    double result() const {
+        return stack[top - 1];
+    }
+
+    // runs at most `budget` more instructions and returns true if the program
+    // has finished. `variables` is called with the slot of every LOAD_VARIABLE
+    template <typename Variables>
+    bool run(Variables const& variables, size_t budget) {
+        size_t end = program.code.size() - pc < budget ? program.code.size() : pc + budget;
+
+        for (; pc < end; pc++) {
+            Instruction instruction = program.code[pc];
+
+            switch (instruction.op) {
+                case OpCode::PUSH_CONSTANT: {
+                    stack[top++] = program.constants[instruction.operand];
+                } break;
+
+                case OpCode::LOAD_VARIABLE: {
+                    stack[top++] = variables(instruction.operand);
+                } break;
+
+                case OpCode::LOAD_LAG:
+                case OpCode::ROLLING_SUM:
+                case OpCode::ROLLING_MEAN: {
+                    throw EvaluationException("Window references need series evaluation");
+                }
+
+                default: {
+                    top--;
+                    stack[top - 1] = apply_binary(instruction.op, stack[top - 1], stack[top]);
+                } break;
+            }
+        }
+
+        return finished();
+    }
+};
+
+template <typename Variables>
+inline double
+evaluate(Program const& program, Variables const& variables, size_t max_instructions = SIZE_MAX) {
+    Execution execution(program);
+
+    if (!execution.run(variables, max_instructions)) {
+        throw EvaluationException("Expression exceeds the instruction limit");
+    }
+
+    return execution.result();
+}
+
+// on x86-64 with GCC or Clang the column loops are compiled once per CPU
+// level and the widest one the CPU supports is picked at startup, so one
+// binary uses AVX2 or AVX-512 where the host has them
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CALCULATOR_MULTIVERSION 1
+#define CALCULATOR_KERNEL_BODY __attribute__((always_inline)) inline
+#else
+#define CALCULATOR_KERNEL_BODY inline
+#endif
+
+enum class CpuLevel {
+    BASELINE,
+    AVX2,
+    AVX512,
+};
+
+inline char const* const cpu_level_names[] = { "baseline", "avx2", "avx512" };
+
+// lhs[i] = lhs[i] op rhs[i]; inlined into one kernel per CPU level
+CALCULATOR_KERNEL_BODY void
+column_loops(OpCode op, double* lhs, double const* rhs, size_t count) {
+    switch (op) {
+        case OpCode::ADD: for (size_t i = 0; i < count; i++) lhs[i] += rhs[i]; break;
+        case OpCode::SUBTRACT: for (size_t i = 0; i < count; i++) lhs[i] -= rhs[i]; break;
+        case OpCode::MULTIPLY: for (size_t i = 0; i < count; i++) lhs[i] *= rhs[i]; break;
+        case OpCode::DIVIDE: for (size_t i = 0; i < count; i++) lhs[i] /= rhs[i]; break;
+        case OpCode::POWER: for (size_t i = 0; i < count; i++) lhs[i] = pow(lhs[i], rhs[i]); break;
+        default: throw EvaluationException("Not a binary operator");
+    }
+}
+
+using ColumnKernel = void (*)(OpCode, double*, double const*, size_t);
+
+inline void
+column_kernel_baseline(OpCode op, double* lhs, double const* rhs, size_t count) {
+    column_loops(op, lhs, rhs, count);
+}
+
+#ifdef CALCULATOR_MULTIVERSION
+__attribute__((target("avx2"))) inline void
+column_kernel_avx2(OpCode op, double* lhs, double const* rhs, size_t count) {
+    column_loops(op, lhs, rhs, count);
+}
+
+__attribute__((target("avx512f"))) inline void
+column_kernel_avx512(OpCode op, double* lhs, double const* rhs, size_t count) {
+    column_loops(op, lhs, rhs, count);
+}
+#endif
+
+// the widest level this CPU can run
+inline CpuLevel
+supported_cpu_level() {
+#ifdef CALCULATOR_MULTIVERSION
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return CpuLevel::AVX512;
+    if (__builtin_cpu_supports("avx2")) return CpuLevel::AVX2;
+#endif
+    return CpuLevel::BASELINE;
+}
+
+// the level the column kernels run at: the supported one, unless the
+// CALCULATOR_CPU_LEVEL environment variable names a lower one to compare
+// against. Benchmarks may change it; nothing else should.
+inline CpuLevel&
+cpu_level() {
+    static CpuLevel level = []() {
+        CpuLevel supported = supported_cpu_level();
+
+        char const* forced = getenv("CALCULATOR_CPU_LEVEL");
+        for (int i = 0; forced && i <= (int)supported; i++) {
+            if (strcmp(forced, cpu_level_names[i]) == 0) return (CpuLevel)i;
+        }
+
+        return supported;
+    }();
+
+    return level;
+}
+
+inline ColumnKernel
+column_kernel(CpuLevel level) {
+    switch (level) {
+#ifdef CALCULATOR_MULTIVERSION
+        case CpuLevel::AVX512: return column_kernel_avx512;
+        case CpuLevel::AVX2: return column_kernel_avx2;
+#endif
+        default: return column_kernel_baseline;
+    }
+}
+
+// applies `op` element-wise, lhs[i] = lhs[i] op rhs[i]
+inline void
+apply_binary_columns(OpCode op, double* lhs, double const* rhs, size_t count) {
+    column_kernel(cpu_level())(op, lhs, rhs, count);
+}
+
+// evaluates a program for `count` rows at once, one instruction at a time
+// over whole columns so that every operator is a plain loop the compiler can
+// vectorize. `column(instruction)` returns the `count` values of any
+// instruction that is not a constant or an operator. `stack` is scratch space.
+template <typename Columns>
+inline void
+evaluate_columns(Program const& program, size_t count, Columns const& column, std::vector<double>& stack, double* out) {
+    stack.resize(stack_depth(program) * count);
+
+    double* top = stack.data();
+
+    for (auto const& instruction : program.code) {
+        switch (instruction.op) {
+            case OpCode::PUSH_CONSTANT: {
+                std::fill(top, top + count, program.constants[instruction.operand]);
+                top += count;
+            } break;
+
+            case OpCode::LOAD_VARIABLE:
+            case OpCode::LOAD_LAG:
+            case OpCode::ROLLING_SUM:
+            case OpCode::ROLLING_MEAN: {
+                double const* values = column(instruction);
+                std::copy(values, values + count, top);
+                top += count;
+            } break;
+
+            default: {
+                top -= count;
+                apply_binary_columns(instruction.op, top - count, top, count);
+            } break;
+        }
+    }
+
+    std::copy(top - count, top, out);
+}
+
+// maps variable names to the dense slots used by LOAD_VARIABLE. The slots
+// are keyed by views of the names, so lookups neither allocate nor write
+// anything and a table can be shared by threads that only read it. A deque
+// never moves its elements, so the views stay valid as names are added.
+struct SymbolTable {
+    std::unordered_map<std::string_view, uint32_t> slots;
+    std::deque<std::string> names;
+
+    SymbolTable() = default;
+    SymbolTable(SymbolTable&&) = default;
+    SymbolTable& operator=(SymbolTable&&) = default;
+
+    // a copy's keys must view the copy's own names
+    SymbolTable(SymbolTable const& other) : names(other.names) {
+        for (uint32_t slot = 0; slot < names.size(); slot++) {
+            slots.emplace(names[slot], slot);
+        }
+    }
+
+    SymbolTable& operator=(SymbolTable const& other) {
+        if (this != &other) {
+            SymbolTable copy(other);
+            *this = std::move(copy);
+        }
+        return *this;
+    }
+
+    uint32_t intern(std::string_view name) {
+        auto found = slots.find(name);
+        if (found != slots.end()) {
+            return found->second;
+        }
+
+        uint32_t slot = (uint32_t)names.size();
+        names.emplace_back(name);
+        slots.emplace(names.back(), slot);
+        return slot;
+    }
+
+    bool find(std::string_view name, uint32_t& slot) const {
+        auto found = slots.find(name);
+        if (found == slots.end()) {
+            return false;
+        }
+
+        slot = found->second;
+        return true;
+    }
+};
+
+// same grammar as Parser, but emits a Program instead of computing the value
+struct Compiler : Parser {
+
+    SymbolTable& symbols;
+    Program program;
+
+    // when set, receives where each instruction came from: the operator of
+    // a binary operation, the whole operand of anything else
+    std::vector<SourceSpan>* spans = nullptr;
+
+    // when set, variables and window references are errors where they occur,
+    // as they are for a Parser with nothing to resolve them
+    bool constants_only = false;
+
+    Compiler(Lexer l, SymbolTable& s) : Parser(l), symbols(s) {}
+
+    Program compile() {
+        compile_expr(1);
+        expect_end();
+        return std::move(program);
+    }
+
+    // an instruction compiled from the tokens `first` through `last`
+    void emit(OpCode op, uint32_t operand, Token first, Token last) {
+        program.code.push_back(Instruction{ op, operand });
+
+        if (spans) {
+            size_t begin = (size_t)(first.string.data() - lexer.source.data());
+            size_t end = (size_t)(last.string.data() - lexer.source.data()) + last.string.length();
+            spans->push_back(SourceSpan{ begin, end });
+        }
+    }
+
+    void emit(OpCode op, Token at) {
+        emit(op, 0, at, at);
+    }
+
+    void compile_atom() {
+        next_token();
+        if (token.type == TokenType::LEFT_PAREN) {
+            compile_expr(1);
+
+            if (token.type != TokenType::RIGHT_PAREN) report_error("Unmatched '(':\n");
+
+            next_token();
+            return;
+        }
+
+        compile_operand();
+    }
+
+    // a number, variable or window reference, with the token at its start
+    void compile_operand() {
+        if (token.type == TokenType::END_OF_FILE) {
+            report_error("Unexpected end of expression: \n");
+        }
+
+        if (token.type == TokenType::IDENTIFIER) {
+            Token name = token;
+            next_token();
+
+            bool window = token.type == TokenType::LEFT_BRACKET || token.type == TokenType::LEFT_PAREN;
+            if (constants_only && window) {
+                report_error(window_reference_error);
+            } else if (constants_only) {
+                Token next = token;
+                token = name;
+                report_error(undefined_variable_error);
+                token = next;
+            }
+
+            if (token.type == TokenType::LEFT_BRACKET) {
+                compile_lag(name);
+            } else if (token.type == TokenType::LEFT_PAREN) {
+                compile_window_function(name);
+            } else {
+                emit(OpCode::LOAD_VARIABLE, symbols.intern(name.string), name, name);
+            }
+            return;
+        }
+
+        if (token.type != TokenType::NUMBER) {
+            report_error("Unexpected character: \n");
+        }
+
+        emit(OpCode::PUSH_CONSTANT, (uint32_t)program.constants.size(), token, token);
+        program.constants.push_back(token_to_number(token));
+        next_token();
+    }
+
+    void expect(TokenType type, char const* error) {
+        if (token.type != type) report_error(error);
+    }
+
+    uint32_t window_length() {
+        expect(TokenType::NUMBER, "Expected a number of time steps:\n");
+
+        double length = token_to_number(token);
+        if (length > UINT32_MAX || length > (double)limits.max_window) report_error("Too many time steps:\n");
+
+        next_token();
+        return (uint32_t)length;
+    }
+
+    // `x[t]` or `x[t-3]`, with the token at the '['
+    void compile_lag(Token name) {
+        next_token();
+        if (token.type != TokenType::IDENTIFIER || token.string != "t") report_error("Expected 't':\n");
+
+        next_token();
+
+        uint32_t lag = 0;
+        if (token.type == TokenType::SUBTRACT) {
+            next_token();
+            lag = window_length();
+        }
+
+        expect(TokenType::RIGHT_BRACKET, "Unmatched '[':\n");
+        Token close = token;
+        next_token();
+
+        uint32_t slot = symbols.intern(name.string);
+
+        if (lag == 0) {
+            emit(OpCode::LOAD_VARIABLE, slot, name, close);
+        } else {
+            emit(OpCode::LOAD_LAG, (uint32_t)program.windows.size(), name, close);
+            program.windows.push_back(Window{ slot, lag });
+        }
+    }
+
+    // `sum(x, 3)` or `mean(x, 3)`, with the token at the '('
+    void compile_window_function(Token name) {
+        OpCode op;
+        if (name.string == "sum") {
+            op = OpCode::ROLLING_SUM;
+        } else if (name.string == "mean") {
+            op = OpCode::ROLLING_MEAN;
+        } else {
+            token = name;
+            report_fatal_error("Unknown function: \n");
+        }
+
+        next_token();
+        expect(TokenType::IDENTIFIER, "Expected a variable:\n");
+        uint32_t slot = symbols.intern(token.string);
+
+        next_token();
+        expect(TokenType::COMMA, "Expected ',':\n");
+
+        next_token();
+        Token length = token;
+        uint32_t steps = window_length();
+        if (steps == 0) {
+            token = length;
+            report_error("Window must span at least one time step:\n");
+        }
+
+        expect(TokenType::RIGHT_PAREN, "Unmatched '(':\n");
+        Token close = token;
+        next_token();
+
+        emit(op, (uint32_t)program.windows.size(), name, close);
+        program.windows.push_back(Window{ slot, steps });
+    }
+
+    void compile_expr(int minimum_precedence) {
+        if (++depth > limits.max_depth) report_fatal_error("Expression is nested too deeply:\n");
+
+        compile_atom();
+
+        while (true) {
+            auto cur = token;
+            if ((cur.type > TokenType::POWER || cur.type < TokenType::ADD)
+                || OperatorMap[cur.type].prec < minimum_precedence) {
+
+                if (cur.type == TokenType::ILLEGAL_CHARACTER) {
+                    report_error("Unknown operator:\n");
+                }
+
+                break;
+            }
+
+            auto op_prec = OperatorMap[cur.type];
+
+            auto next_min_prec =
+                op_prec.assoc == Associativity::LEFT ? op_prec.prec + 1 : op_prec.prec;
+
+            compile_expr(next_min_prec);
+            emit(OpCode(cur.type), cur);
+        }
+
+        depth--;
+    }
+};
+
+// the same grammar parsed with Dijkstra's shunting-yard algorithm: one loop
+// over the tokens with an explicit stack of pending operators and '('
+struct ShuntingYardCompiler : Compiler {
+
+    static constexpr size_t inline_depth = 32;
+
+    Token inline_pending[inline_depth];
+    std::vector<Token> heap_pending;
+
+    using Compiler::Compiler;
+
+    Program compile() {
+        Token* pending = inline_pending;
+        size_t capacity = inline_depth;
+        size_t top = 0;
+        size_t open_parens = 0;
+
+        // emits pending operators down to the innermost '('
+        auto unwind = [&]() {
+            while (top > 0 && pending[top - 1].type != TokenType::LEFT_PAREN) {
+                top--;
+                emit(OpCode(pending[top].type), pending[top]);
+            }
+        };
+
+        // every pending '(' or operator is a level of recursion in the
+        // climbing parser, which counts the whole expression as one more
+        auto push = [&](Token pushed) {
+            if (top + 2 > limits.max_depth) report_fatal_error("Expression is nested too deeply:\n");
+
+            if (top == capacity) {
+                if (pending == inline_pending) heap_pending.assign(pending, pending + top);
+                heap_pending.resize(capacity * 2);
+                pending = heap_pending.data();
+                capacity *= 2;
+            }
+
+            pending[top++] = pushed;
+        };
+
+        while (true) {
+            next_token();
+            while (token.type == TokenType::LEFT_PAREN) {
+                push(token);
+                open_parens++;
+                next_token();
+            }
+
+            compile_operand();
+
+            while (token.type == TokenType::RIGHT_PAREN && open_parens > 0) {
+                unwind();
+                top--;
+                open_parens--;
+                next_token();
+            }
+
+            auto cur = token;
+            if (cur.type > TokenType::POWER || cur.type < TokenType::ADD) {
+                if (cur.type == TokenType::ILLEGAL_CHARACTER) {
+                    report_error("Unknown operator:\n");
+                }
+
+                break;
+            }
+
+            auto op_prec = OperatorMap[cur.type];
+
+            while (top > 0 && pending[top - 1].type != TokenType::LEFT_PAREN) {
+                auto top_prec = OperatorMap[pending[top - 1].type];
+                if (top_prec.prec < op_prec.prec
+                    || (top_prec.prec == op_prec.prec && op_prec.assoc == Associativity::RIGHT)) {
+                    break;
+                }
+
+                top--;
+                emit(OpCode(pending[top].type), pending[top]);
+            }
+
+            push(cur);
+        }
+
+        unwind();
+        if (open_parens > 0) report_error("Unmatched '(':\n");
+        expect_end();
+
+        return std::move(program);
+    }
+};
+
+// the same grammar parsed by a Pratt parser: every operator has a left and a
+// right binding power, and an operator only takes the expression to its left
+// when it binds tighter than the operator before it
+struct PrattCompiler : Compiler {
+
+    using Compiler::Compiler;
+
+    Program compile() {
+        compile_expr(0);
+        expect_end();
+        return std::move(program);
+    }
+
+    static int left_binding_power(TokenType type) {
+        return OperatorMap[type].prec * 2;
+    }
+
+    static int right_binding_power(TokenType type) {
+        return OperatorMap[type].assoc == Associativity::LEFT ? OperatorMap[type].prec * 2 : OperatorMap[type].prec * 2 - 1;
+    }
+
+    void compile_expr(int binding_power) {
+        if (++depth > limits.max_depth) report_fatal_error("Expression is nested too deeply:\n");
+
+        next_token();
+        if (token.type == TokenType::LEFT_PAREN) {
+            compile_expr(0);
+
+            if (token.type != TokenType::RIGHT_PAREN) report_error("Unmatched '(':\n");
+
+            next_token();
+        } else {
+            compile_operand();
+        }
+
+        while (true) {
+            auto cur = token;
+            if (cur.type > TokenType::POWER || cur.type < TokenType::ADD
+                || left_binding_power(cur.type) <= binding_power) {
+
+                if (cur.type == TokenType::ILLEGAL_CHARACTER) {
+                    report_error("Unknown operator:\n");
+                }
+
+                break;
+            }
+
+            compile_expr(right_binding_power(cur.type));
+            emit(OpCode(cur.type), cur);
+        }
+
+        depth--;
+    }
+};
+
+// reads expressions written in reverse Polish notation, `1 2 3 * +`, with
+// one linear scan: operands are emitted as they come and every operator
+// applies to the two values before it, so there is no precedence to resolve
+struct RpnCompiler : Compiler {
+
+    using Compiler::Compiler;
+
+    Program compile() {
+        size_t values = 0;
+
+        next_token();
+        while (token.type != TokenType::END_OF_FILE) {
+            if (token.type >= TokenType::ADD && token.type <= TokenType::POWER) {
+                if (values < 2) report_error("Missing operand:\n");
+
+                emit(OpCode(token.type), token);
+                values--;
+                next_token();
+            } else {
+                // operands waiting for their operator nest like parentheses
+                if (values >= limits.max_depth) report_fatal_error("Expression is nested too deeply:\n");
+
+                compile_operand();
+                values++;
+            }
+        }
+
+        if (values == 0) report_error("Unexpected end of expression: \n");
+        if (values > 1) report_error("Missing operator:\n");
+
+        return std::move(program);
+    }
+};
+
+// the parsing strategies an expression can be compiled with
+enum class Engine {
+    CLIMBING,
+    SHUNTING_YARD,
+    PRATT,
+    RPN,
+};
+
+inline bool
+parse_engine(std::string_view name, Engine& engine) {
+    if (name == "climbing") {
+        engine = Engine::CLIMBING;
+    } else if (name == "shunting-yard") {
+        engine = Engine::SHUNTING_YARD;
+    } else if (name == "pratt") {
+        engine = Engine::PRATT;
+    } else if (name == "rpn") {
+        engine = Engine::RPN;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+template <typename EngineCompiler>
+inline Program
+compile_with(Lexer lexer, SymbolTable& symbols, Limits const& limits, std::vector<SourceSpan>* spans, bool constants_only,
+    Program&& storage) {
+    EngineCompiler compiler(lexer, symbols);
+    compiler.limits = limits;
+    compiler.spans = spans;
+    compiler.constants_only = constants_only;
+
+    compiler.program = std::move(storage);
+    compiler.program.code.clear();
+    compiler.program.constants.clear();
+    compiler.program.windows.clear();
+
+    return compiler.compile();
+}
+
+// `spans`, when given, receives the source span of every instruction;
+// `constants_only` makes variables and window references errors. The program
+// is built in the vectors of `storage`, keeping whatever capacity they have.
+inline Program
+compile(Engine engine, Lexer lexer, SymbolTable& symbols, Limits const& limits, std::vector<SourceSpan>* spans = nullptr,
+    bool constants_only = false, Program&& storage = Program()) {
+    switch (engine) {
+        case Engine::SHUNTING_YARD:
+            return compile_with<ShuntingYardCompiler>(lexer, symbols, limits, spans, constants_only, std::move(storage));
+        case Engine::PRATT:
+            return compile_with<PrattCompiler>(lexer, symbols, limits, spans, constants_only, std::move(storage));
+        case Engine::RPN:
+            return compile_with<RpnCompiler>(lexer, symbols, limits, spans, constants_only, std::move(storage));
+        default:
+            return compile_with<Compiler>(lexer, symbols, limits, spans, constants_only, std::move(storage));
+    }
+}
+
+// rewrites `program` with the variables in `bindings` replaced by constants,
+// folding constant subexpressions and replacing operations with cheaper ones
+// wherever the result is bit-identical
+inline Program
+specialize(Program const& program, std::unordered_map<uint32_t, double> const& bindings) {
+    Program result;
+
+    // one entry per value on the evaluation stack: where the code computing
+    // it starts, and its value if it is a single PUSH_CONSTANT
+    struct Value {
+        size_t start;
+        bool constant;
+        double number;
+    };
+
+    std::vector<Value> stack;
+
+    auto push_constant = [&](double number) {
+        stack.push_back(Value{ result.code.size(), true, number });
+        result.code.push_back(Instruction{ OpCode::PUSH_CONSTANT, (uint32_t)result.constants.size() });
+        result.constants.push_back(number);
+    };
+
+    for (auto const& instruction : program.code) {
+        switch (instruction.op) {
+            case OpCode::PUSH_CONSTANT: {
+                push_constant(program.constants[instruction.operand]);
+            } break;
+
+            case OpCode::LOAD_VARIABLE: {
+                auto bound = bindings.find(instruction.operand);
+                if (bound != bindings.end()) {
+                    push_constant(bound->second);
+                } else {
+                    stack.push_back(Value{ result.code.size(), false, 0 });
+                    result.code.push_back(instruction);
+                }
+            } break;
+
+            case OpCode::LOAD_LAG:
+            case OpCode::ROLLING_SUM:
+            case OpCode::ROLLING_MEAN: {
+                stack.push_back(Value{ result.code.size(), false, 0 });
+                result.code.push_back(Instruction{ instruction.op, (uint32_t)result.windows.size() });
+                result.windows.push_back(program.windows[instruction.operand]);
+            } break;
+
+            default: {
+                Value rhs = stack.back();
+                stack.pop_back();
+                Value lhs = stack.back();
+                stack.pop_back();
+
+                OpCode op = instruction.op;
+
+                if (lhs.constant && rhs.constant) {
+                    result.code.resize(lhs.start);
+                    push_constant(apply_binary(op, lhs.number, rhs.number));
+                    continue;
+                }
+
+                if (rhs.constant) {
+                    double c = rhs.number;
+                    int exponent;
+
+                    if ((op == OpCode::SUBTRACT && c == 0) ||
+                        ((op == OpCode::MULTIPLY || op == OpCode::DIVIDE || op == OpCode::POWER) && c == 1)) {
+                        // x - 0, x * 1, x / 1, x ** 1
+                        result.code.pop_back();
+                        stack.push_back(lhs);
+                        continue;
+                    }
+
+                    if (op == OpCode::POWER && c == 0) {
+                        // pow(x, 0) is 1 even for NaN
+                        result.code.resize(lhs.start);
+                        push_constant(1);
+                        continue;
+                    }
+
+                    // x ** 2 is left alone: pow isn't correctly rounded, so x * x can differ in the last bit
+
+                    if (op == OpCode::DIVIDE && std::fabs(frexp(c, &exponent)) == 0.5 && std::isnormal(1 / c)) {
+                        // dividing by a power of two is the same as multiplying by its exact reciprocal
+                        result.code.back().operand = (uint32_t)result.constants.size();
+                        result.constants.push_back(1 / c);
+                        op = OpCode::MULTIPLY;
+                    }
+                }
+
+                if (lhs.constant && op == OpCode::MULTIPLY && lhs.number == 1) {
+                    // 1 * x
+                    result.code.erase(result.code.begin() + lhs.start);
+                    stack.push_back(Value{ lhs.start, false, 0 });
+                    continue;
+                }
+
+                result.code.push_back(Instruction{ op, 0 });
+                stack.push_back(Value{ lhs.start, false, 0 });
+            } break;
+        }
+    }
+
+    // drop the constants that folding left unused and merge duplicates
+    std::vector<double> constants;
+    std::unordered_map<uint64_t, uint32_t> indices;
+
+    for (auto& instruction : result.code) {
+        if (instruction.op != OpCode::PUSH_CONSTANT) continue;
+
+        double number = result.constants[instruction.operand];
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+
+        auto inserted = indices.emplace(bits, (uint32_t)constants.size());
+        if (inserted.second) {
+            constants.push_back(number);
+        }
+
+        instruction.operand = inserted.first->second;
+    }
+
+    result.constants = std::move(constants);
+    return result;
+}
+
+inline Program
+optimize(Program const& program) {
+    return specialize(program, {});
+}
+
+// one line per instruction, indented
+inline std::string
+format_program(Program const& program, SymbolTable const& symbols) {
+    static char const* const names[] = { "add", "subtract", "multiply", "divide", "power" };
+
+    std::string listing;
+    char buffer[64];
+
+    for (auto const& instruction : program.code) {
+        switch (instruction.op) {
+            case OpCode::PUSH_CONSTANT: {
+                snprintf(buffer, sizeof(buffer), "    push %g\n", program.constants[instruction.operand]);
+                listing += buffer;
+            } break;
+            case OpCode::LOAD_VARIABLE: listing += "    load " + symbols.names[instruction.operand] + "\n"; break;
+            case OpCode::LOAD_LAG:
+            case OpCode::ROLLING_SUM:
+            case OpCode::ROLLING_MEAN: {
+                Window window = program.windows[instruction.operand];
+                snprintf(buffer, sizeof(buffer), " %u\n", window.length);
+                listing += instruction.op == OpCode::LOAD_LAG ? "    lag " : instruction.op == OpCode::ROLLING_SUM ? "    sum " : "    mean ";
+                listing += symbols.names[window.slot];
+                listing += buffer;
+            } break;
+            default: listing += std::string("    ") + names[(int)instruction.op] + "\n"; break;
+        }
+    }
+
+    return listing;
+}
+
+// writes `program` in reverse Polish notation, which RpnCompiler reads back
+// into the same program
+inline std::string
+to_rpn(Program const& program, SymbolTable const& symbols) {
+    static char const* const operators[] = { "+", "-", "*", "/", "**" };
+
+    std::string rpn;
+    char buffer[400];
+    static_assert(sizeof(buffer) > 309 + 1, "room for the largest whole double");
+
+    for (auto const& instruction : program.code) {
+        if (!rpn.empty()) rpn += ' ';
+
+        switch (instruction.op) {
+            case OpCode::PUSH_CONSTANT: {
+                // the lexer only reads digits, which whole numbers keep exact.
+                // Infinity is written as a number too large for a double,
+                // which reads back as infinity again.
+                double number = program.constants[instruction.operand];
+                if (number == INFINITY) {
+                    rpn += '1';
+                    rpn.append(309, '0');
+                } else if (number >= 0 && number == std::floor(number)) {
+                    snprintf(buffer, sizeof(buffer), "%.0f", number);
+                    rpn += buffer;
+                } else {
+                    throw EvaluationException("Constant cannot be written in reverse Polish notation");
+                }
+            } break;
+
+            case OpCode::LOAD_VARIABLE: rpn += symbols.names[instruction.operand]; break;
+
+            case OpCode::LOAD_LAG: {
+                Window window = program.windows[instruction.operand];
+                snprintf(buffer, sizeof(buffer), "[t-%u]", window.length);
+                rpn += symbols.names[window.slot];
+                rpn += buffer;
+            } break;
+
+            case OpCode::ROLLING_SUM:
+            case OpCode::ROLLING_MEAN: {
+                Window window = program.windows[instruction.operand];
+                snprintf(buffer, sizeof(buffer), ", %u)", window.length);
+                rpn += instruction.op == OpCode::ROLLING_SUM ? "sum(" : "mean(";
+                rpn += symbols.names[window.slot];
+                rpn += buffer;
+            } break;
+
+            default: rpn += operators[(int)instruction.op]; break;
+        }
+    }
+
+    return rpn;
+}
+
+// where the time evaluating a program goes. Every instruction stands for the
+// subexpression whose value it computes: `extents` is that subexpression's
+// source and `parents` the operation that consumes its value, SIZE_MAX for
+// the last instruction. `self` is the mean time of the instruction itself
+// per evaluation in nanoseconds, `inclusive` that plus its operands' time.
+// `whole` is the mean time of an evaluation without profiling, which the
+// times of the instructions are scaled to add up to.
+struct Profile {
+    std::vector<SourceSpan> spans;
+    std::vector<SourceSpan> extents;
+    std::vector<size_t> parents;
+    std::vector<double> self;
+    std::vector<double> inclusive;
+    double whole = 0;
+    size_t runs = 0;
+};
+
+// the subexpression tree of `program`, compiled from `source` with `spans`:
+// the extents and parents of a Profile, with every time still 0
+inline Profile
+profile_tree(Program const& program, std::vector<SourceSpan> const& spans, std::string_view source) {
+    Profile result;
+    size_t size = program.code.size();
+    result.spans = spans;
+    result.extents.resize(size);
+    result.parents.assign(size, SIZE_MAX);
+    result.self.assign(size, 0);
+
+    std::vector<size_t> stack;
+    for (size_t i = 0; i < size; i++) {
+        result.extents[i] = spans[i];
+
+        if (program.code[i].op <= OpCode::POWER) {
+            size_t rhs = stack.back();
+            stack.pop_back();
+            size_t lhs = stack.back();
+            stack.pop_back();
+
+            result.parents[lhs] = result.parents[rhs] = i;
+            result.extents[i].begin = std::min(result.extents[lhs].begin, spans[i].begin);
+            result.extents[i].end = std::max(result.extents[rhs].end, spans[i].end);
+        }
+
+        // take in the parentheses around the subexpression. Its operands
+        // already have theirs, so its text is balanced and a '(' just before
+        // it pairs with a ')' just after it.
+        SourceSpan& extent = result.extents[i];
+        for (;;) {
+            size_t before = extent.begin;
+            while (before > 0 && isspace((unsigned char)source[before - 1])) before--;
+            size_t after = extent.end;
+            while (after < source.length() && isspace((unsigned char)source[after])) after++;
+
+            if (before == 0 || after == source.length() || source[before - 1] != '(' || source[after] != ')') break;
+
+            extent = SourceSpan{ before - 1, after + 1 };
+        }
+
+        stack.push_back(i);
+    }
+
+    return result;
+}
+
+// evaluates `program`, compiled from `source` with `spans`, over and over
+// for about `seconds`, timing one instruction at a time. This single-steps an
+// Execution, so ordinary evaluation carries no profiling code at all.
+template <typename Variables>
+inline Profile
+profile(Program const& program, std::vector<SourceSpan> const& spans, std::string_view source, Variables const& variables,
+    double seconds, size_t max_instructions = SIZE_MAX) {
+    using Clock = std::chrono::steady_clock;
+
+    // every evaluation runs each instruction exactly once
+    size_t size = program.code.size();
+    if (size > max_instructions) {
+        throw EvaluationException("Expression exceeds the instruction limit");
+    }
+
+    Profile result = profile_tree(program, spans, source);
+
+    // what a step costs that runs no instruction: reading the clock around
+    // run() on an Execution that has already finished. It is taken off every
+    // measurement.
+    Execution finished(program);
+    finished.run(variables, SIZE_MAX);
+
+    static constexpr int calibration_steps = 10000;
+    std::chrono::nanoseconds harness{ 0 };
+    for (int i = 0; i < calibration_steps; i++) {
+        auto before = Clock::now();
+        finished.run(variables, 1);
+        harness += Clock::now() - before;
+    }
+
+    std::vector<std::chrono::nanoseconds> elapsed(size, std::chrono::nanoseconds{ 0 });
+    auto deadline = Clock::now() + std::chrono::duration<double>(seconds);
+
+    do {
+        Execution execution(program);
+
+        while (!execution.finished()) {
+            size_t pc = execution.pc;
+            auto before = Clock::now();
+            execution.run(variables, 1);
+            elapsed[pc] += Clock::now() - before;
+        }
+
+        result.runs++;
+    } while (Clock::now() < deadline);
+
+    // the same number of evaluations again, run straight through
+    volatile double sink = 0;
+    auto start = Clock::now();
+    for (size_t run = 0; run < result.runs; run++) {
+        Execution execution(program);
+        execution.run(variables, SIZE_MAX);
+        sink = execution.result();
+    }
+    (void)sink;
+    result.whole = (double)std::chrono::nanoseconds(Clock::now() - start).count() / (double)result.runs;
+
+    double overhead = (double)harness.count() / calibration_steps;
+    double measured = 0;
+    for (size_t i = 0; i < size; i++) {
+        result.self[i] = std::max(0.0, (double)elapsed[i].count() / (double)result.runs - overhead);
+        measured += result.self[i];
+    }
+
+    // single steps still cost more than running through; keep their shares
+    if (measured > 0) {
+        for (double& self : result.self) self *= result.whole / measured;
+    }
+
+    // operands come before the operation that consumes them
+    result.inclusive = result.self;
+    for (size_t i = 0; i < size; i++) {
+        if (result.parents[i] != SIZE_MAX) result.inclusive[result.parents[i]] += result.inclusive[i];
+    }
+
+    return result;
+}
+
+// one line per instruction in the folded stack format that flame graph tools
+// read: the subexpressions from the whole expression down to the
+// instruction's own, separated by ';', then its total time in nanoseconds
+// over all runs
+inline std::string
+folded_stacks(Profile const& profile, std::string_view source) {
+    std::string folded;
+    std::vector<size_t> path;
+
+    for (size_t i = 0; i < profile.self.size(); i++) {
+        path.clear();
+        for (size_t node = i; node != SIZE_MAX; node = profile.parents[node]) {
+            path.push_back(node);
+        }
+
+        for (size_t j = path.size(); j-- > 0;) {
+            SourceSpan extent = profile.extents[path[j]];
+            for (char c : source.substr(extent.begin, extent.end - extent.begin)) {
+                // ';' separates frames and a line break ends the stack
+                folded += c == ';' || c == '\n' || c == '\r' ? ' ' : c;
+            }
+            folded += j > 0 ? ';' : ' ';
+        }
+
+        folded += std::to_string(std::llround(profile.self[i] * (double)profile.runs));
+        folded += '\n';
+    }
+
+    return folded;
+}
+
+// the source, then one row per subexpression from the whole expression down:
+// its operands underlined with '~' under the instruction's own tokens marked
+// with '^', its share of the evaluation time, and its time with and without
+// its operands
+inline std::string
+annotate_profile(Profile const& profile, std::string_view source) {
+    size_t size = profile.self.size();
+
+    double total = size > 0 ? profile.inclusive[size - 1] : 0;
+
+    std::string view = " ";
+    for (char c : source) view += c == '\n' || c == '\r' || c == '\t' ? ' ' : c;
+    view += '\n';
+
+    // depth first from the root, operands in source order
+    std::vector<size_t> pending;
+    if (size > 0) pending.push_back(size - 1);
+
+    while (!pending.empty()) {
+        size_t node = pending.back();
+        pending.pop_back();
+
+        SourceSpan extent = profile.extents[node];
+        SourceSpan span = profile.spans[node];
+
+        std::string row(extent.end + 1, ' ');
+        for (size_t i = extent.begin; i < extent.end; i++) row[i + 1] = '~';
+        for (size_t i = span.begin; i < span.end; i++) row[i + 1] = '^';
+        row.resize(std::max(row.size(), source.length() + 1) + 2, ' ');
+
+        double inclusive = profile.inclusive[node];
+        char numbers[96];
+        snprintf(numbers, sizeof(numbers), "%5.1f%%  %9.2f ns  (self %.2f ns)\n",
+            total > 0 ? inclusive / total * 100 : 0.0, inclusive, profile.self[node]);
+
+        view += row;
+        view += numbers;
+
+        for (size_t i = node; i-- > 0;) {
+            if (profile.parents[i] == node) pending.push_back(i);
+        }
+    }
+
+    char summary[96];
+    snprintf(summary, sizeof(summary), " %zu evaluations, %.2f ns each without profiling\n", profile.runs, profile.whole);
+    view += summary;
+
+    return view;
+}
+
+// binary encoding of a Program for sending compiled expressions between
+// processes. All integers are LEB128 varints and constants are 8 bytes,
+// little-endian:
+//
+//     "PCB" version
+//     constant count, constants           (each distinct value once)
+//     name count, (length, bytes) ...     (variables, by name, not slot)
+//     window count, (name, length) ...
+//     instruction count, (opcode, [operand]) ...
+//
+// Binary opcodes have no operand; the others index the table they load from.
+inline constexpr char encoding_magic[3] = { 'P', 'C', 'B' };
+inline constexpr uint8_t encoding_version = 1;
+
+inline void
+put_varint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out += (char)(value | 0x80);
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+inline std::string
+encode_program(Program const& program, SymbolTable const& symbols) {
+    std::string out(encoding_magic, sizeof(encoding_magic));
+    out += (char)encoding_version;
+
+    std::vector<uint32_t> constant_index(program.constants.size());
+    std::vector<double> constants;
+    std::unordered_map<uint64_t, uint32_t> seen;
+    for (size_t i = 0; i < program.constants.size(); i++) {
+        uint64_t bits;
+        memcpy(&bits, &program.constants[i], sizeof(bits));
+        auto inserted = seen.emplace(bits, (uint32_t)constants.size());
+        if (inserted.second) constants.push_back(program.constants[i]);
+        constant_index[i] = inserted.first->second;
+    }
+
+    // slots are local to a SymbolTable, so only the names that are used go
+    // out, numbered in order of first use
+    std::vector<uint32_t> name_of_slot(symbols.names.size(), UINT32_MAX);
+    std::vector<uint32_t> names;
+    auto name_index = [&](uint32_t slot) {
+        if (name_of_slot[slot] == UINT32_MAX) {
+            name_of_slot[slot] = (uint32_t)names.size();
+            names.push_back(slot);
+        }
+        return name_of_slot[slot];
+    };
+
+    std::string code;
+    for (auto const& instruction : program.code) {
+        code += (char)instruction.op;
+        switch (instruction.op) {
+            case OpCode::PUSH_CONSTANT: put_varint(code, constant_index[instruction.operand]); break;
+            case OpCode::LOAD_VARIABLE: put_varint(code, name_index(instruction.operand)); break;
+            case OpCode::LOAD_LAG:
+            case OpCode::ROLLING_SUM:
+            case OpCode::ROLLING_MEAN: put_varint(code, instruction.operand); break;
+            default: break;
+        }
+    }
+
+    std::vector<uint32_t> window_names;
+    for (auto const& window : program.windows) {
+        window_names.push_back(name_index(window.slot));
+    }
+
+    put_varint(out, constants.size());
+    for (double constant : constants) {
+        uint64_t bits;
+        memcpy(&bits, &constant, sizeof(bits));
+        for (int i = 0; i < 8; i++) out += (char)(bits >> (i * 8));
+    }
+
+    put_varint(out, names.size());
+    for (uint32_t slot : names) {
+        put_varint(out, symbols.names[slot].length());
+        out += symbols.names[slot];
+    }
+
+    put_varint(out, program.windows.size());
+    for (size_t i = 0; i < program.windows.size(); i++) {
+        put_varint(out, window_names[i]);
+        put_varint(out, program.windows[i].length);
+    }
+
+    put_varint(out, program.code.size());
+    out += code;
+
+    return out;
+}
+
+// reads an encoded program in place. open() checks the whole buffer once, so
+// that evaluate() can run straight from the bytes without bounds checks or
+// copying the program out; the buffer must outlive the reader.
+struct EncodedProgram {
+
+    static constexpr size_t inline_depth = 32;
+
+    uint8_t const* constants = nullptr;
+    size_t constant_count = 0;
+    std::vector<std::string_view> names;
+    std::vector<Window> windows;
+    uint8_t const* code = nullptr;
+    uint8_t const* code_end = nullptr;
+    size_t instructions = 0;
+    size_t max_depth = 0;
+
+    struct Reader {
+        uint8_t const* p;
+        uint8_t const* end;
+
+        // at most `max_bits` bits in as many bytes as that takes, so no
+        // overlong encoding can make a later decoder shift out of range
+        uint64_t varint(int max_bits = 64) {
+            uint64_t value = 0;
+            for (int shift = 0; shift < max_bits; shift += 7) {
+                if (p == end) throw EvaluationException("Truncated program");
+                uint8_t byte = *p++;
+                if (max_bits - shift < 7 && (byte & 0x7f) >> (max_bits - shift) != 0) {
+                    throw EvaluationException("Malformed varint");
+                }
+                value |= (uint64_t)(byte & 0x7f) << shift;
+                if (!(byte & 0x80)) return value;
+            }
+            throw EvaluationException("Malformed varint");
+        }
+
+        uint8_t const* bytes(uint64_t count) {
+            if ((uint64_t)(end - p) < count) throw EvaluationException("Truncated program");
+            uint8_t const* start = p;
+            p += count;
+            return start;
+        }
+    };
+
+    void open(void const* data, size_t size) {
+        Reader in{ (uint8_t const*)data, (uint8_t const*)data + size };
+
+        uint8_t const* header = in.bytes(sizeof(encoding_magic) + 1);
+        if (memcmp(header, encoding_magic, sizeof(encoding_magic)) != 0) {
+            throw EvaluationException("Not an encoded program");
+        }
+        if (header[sizeof(encoding_magic)] != encoding_version) {
+            throw EvaluationException("Unsupported program version " + std::to_string(header[sizeof(encoding_magic)]));
+        }
+
+        uint64_t constant_total = in.varint();
+        if (constant_total > size) throw EvaluationException("Truncated program");
+        constants = in.bytes(constant_total * 8);
+        constant_count = (size_t)constant_total;
+
+        uint64_t name_count = in.varint();
+        if (name_count > size) throw EvaluationException("Truncated program");
+        names.clear();
+        for (uint64_t i = 0; i < name_count; i++) {
+            uint64_t length = in.varint();
+            names.emplace_back((char const*)in.bytes(length), (size_t)length);
+        }
+
+        uint64_t window_count = in.varint();
+        if (window_count > size) throw EvaluationException("Truncated program");
+        windows.clear();
+        for (uint64_t i = 0; i < window_count; i++) {
+            uint64_t name = in.varint();
+            uint64_t length = in.varint();
+            if (name >= name_count || length == 0 || length > UINT32_MAX) throw EvaluationException("Malformed window");
+            windows.push_back(Window{ (uint32_t)name, (uint32_t)length });
+        }
+
+        instructions = in.varint();
+        code = in.p;
+
+        // every operand must be in range and every operator must find two
+        // values on the stack, leaving exactly one at the end
+        size_t depth = 0;
+        max_depth = 0;
+        for (uint64_t i = 0; i < instructions; i++) {
+            OpCode op = (OpCode)*in.bytes(1);
+            uint64_t limit;
+
+            switch (op) {
+                case OpCode::PUSH_CONSTANT: limit = constant_count; break;
+                case OpCode::LOAD_VARIABLE: limit = name_count; break;
+                case OpCode::LOAD_LAG:
+                case OpCode::ROLLING_SUM:
+                case OpCode::ROLLING_MEAN: limit = window_count; break;
+                default: {
+                    if (op > OpCode::POWER || depth < 2) throw EvaluationException("Malformed program");
+                    depth--;
+                    continue;
+                }
+            }
+
+            if (in.varint(32) >= limit) throw EvaluationException("Malformed program");
+            max_depth = std::max(max_depth, ++depth);
+        }
+
+        if (depth != 1) throw EvaluationException("Malformed program");
+        if (in.p != in.end) throw EvaluationException("Trailing bytes after program");
+        code_end = in.p;
+    }
+
+    // reads a varint already checked by open(), which is at most 5 bytes
+    static uint32_t operand(uint8_t const*& p) {
+        uint32_t value = 0;
+        for (int shift = 0; shift < 32; shift += 7) {
+            uint8_t byte = *p++;
+            value |= (uint32_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) break;
+        }
+        return value;
+    }
+
+    double constant(uint32_t index) const {
+        uint64_t bits = 0;
+        for (int i = 0; i < 8; i++) bits |= (uint64_t)constants[index * 8 + i] << (i * 8);
+
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    // `variables` is called with the index in `names` of every variable read
+    template <typename Variables>
+    double evaluate(Variables const& variables) const {
+        double inline_stack[inline_depth] = {};
+        std::vector<double> heap_stack;
+        double* stack = inline_stack;
+        if (max_depth > inline_depth) {
+            heap_stack.resize(max_depth);
+            stack = heap_stack.data();
+        }
+
+        size_t top = 0;
+        for (uint8_t const* p = code; p != code_end; ) {
+            OpCode op = (OpCode)*p++;
+
+            switch (op) {
+                case OpCode::PUSH_CONSTANT: stack[top++] = constant(operand(p)); break;
+                case OpCode::LOAD_VARIABLE: stack[top++] = variables(operand(p)); break;
+                case OpCode::LOAD_LAG:
+                case OpCode::ROLLING_SUM:
+                case OpCode::ROLLING_MEAN: throw EvaluationException("Window references need series evaluation");
+                default: {
+                    top--;
+                    stack[top - 1] = apply_binary(op, stack[top - 1], stack[top]);
+                } break;
+            }
+        }
+
+        return stack[0];
+    }
+
+    // copies the program out, with its names interned in `symbols`
+    Program decode(SymbolTable& symbols) const {
+        Program program;
+
+        std::vector<uint32_t> slots;
+        for (auto name : names) slots.push_back(symbols.intern(name));
+
+        for (uint32_t i = 0; i < constant_count; i++) {
+            program.constants.push_back(constant(i));
+        }
+
+        for (auto const& window : windows) {
+            program.windows.push_back(Window{ slots[window.slot], window.length });
+        }
+
+        for (uint8_t const* p = code; p != code_end; ) {
+            OpCode op = (OpCode)*p++;
+            uint32_t value = op <= OpCode::POWER ? 0 : operand(p);
+            program.code.push_back(Instruction{ op, op == OpCode::LOAD_VARIABLE ? slots[value] : value });
+        }
+
+        return program;
+    }
+};
@@ -0,0 +1,106 @@
+#define CALC_EXPORTS
+
+#include "calculator_api.h"
+#include "calculator.h"
+
+#include <new>
+
+struct calc_expression {
+    SymbolTable symbols;
+    Program program;
+    std::string error;
+};
+
+calc_expression*
+calc_compile(char const* source, size_t length) {
+    calc_expression* expression = new (std::nothrow) calc_expression;
+    if (!expression) return nullptr;
+
+    try {
+        Compiler compiler(Lexer(std::string_view(source, length)), expression->symbols);
+        Program program = compiler.compile();
+
+        for (auto const& instruction : program.code) {
+            if (instruction.op == OpCode::LOAD_LAG || instruction.op == OpCode::ROLLING_SUM
+                || instruction.op == OpCode::ROLLING_MEAN) {
+                throw EvaluationException("Window references need series evaluation");
+            }
+        }
+
+        expression->program = optimize(program);
+
+    } catch (std::bad_alloc&) {
+        delete expression;
+        return nullptr;
+    } catch (std::exception& e) {
+        try {
+            expression->error = e.what();
+        } catch (std::bad_alloc&) {
+            delete expression;
+            return nullptr;
+        }
+    }
+
+    return expression;
+}
+
+char const*
+calc_error(calc_expression const* expression) {
+    return expression->error.empty() ? nullptr : expression->error.c_str();
+}
+
+size_t
+calc_variable_count(calc_expression const* expression) {
+    return expression->symbols.names.size();
+}
+
+char const*
+calc_variable_name(calc_expression const* expression, size_t index) {
+    return index < expression->symbols.names.size() ? expression->symbols.names[index].c_str() : nullptr;
+}
+
+calc_status
+calc_evaluate(calc_expression const* expression, double const* variables, double* result) {
+    if (!expression->error.empty()) return CALC_INVALID_EXPRESSION;
+
+    // typical expressions evaluate on Execution's inline stack, so this
+    // neither allocates nor throws
+    try {
+        *result = evaluate(expression->program, [variables](uint32_t slot) {
+            return variables[slot];
+        });
+    } catch (std::bad_alloc&) {
+        return CALC_OUT_OF_MEMORY;
+    }
+
+    return CALC_OK;
+}
+
+calc_status
+calc_evaluate_columns(calc_expression const* expression, double const* const* columns, size_t rows, double* results) {
+    // rows are evaluated in blocks so that the scratch stack stays in cache;
+    // each thread keeps its own, so concurrent calls share nothing
+    static constexpr size_t block = 1024;
+    thread_local std::vector<double> stack;
+
+    if (!expression->error.empty()) return CALC_INVALID_EXPRESSION;
+
+    try {
+        for (size_t first = 0; first < rows; first += block) {
+            size_t count = std::min(block, rows - first);
+
+            evaluate_columns(expression->program, count, [columns, first](Instruction instruction) {
+                return columns[instruction.operand] + first;
+            }, stack, results + first);
+        }
+    } catch (std::bad_alloc&) {
+        return CALC_OUT_OF_MEMORY;
+    }
+
+    return CALC_OK;
+}
+
+void
+calc_free(calc_expression* expression) {
+    delete expression;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+/*
+ * C interface to the calculator, for embedding it in programs that are not
+ * written in C++. No C++ exception ever leaves these functions.
+ *
+ * A compiled expression is immutable: once calc_compile() has returned, any
+ * number of threads may evaluate the same expression at the same time.
+ * calc_free() must not run concurrently with other calls on that expression.
+ */
+
+#include <stddef.h>
+
+#ifdef _WIN32
+#ifdef CALC_EXPORTS
+#define CALC_API __declspec(dllexport)
+#else
+#define CALC_API __declspec(dllimport)
+#endif
+#else
+#define CALC_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct calc_expression calc_expression;
+
+typedef enum calc_status {
+    CALC_OK = 0,
+    /* the expression did not compile; calc_error() says why */
+    CALC_INVALID_EXPRESSION,
+    CALC_OUT_OF_MEMORY,
+} calc_status;
+
+/*
+ * Compiles `length` bytes of `source`, which need not be NUL-terminated.
+ * Returns NULL only if there is not enough memory. An expression that fails
+ * to compile still returns a handle, for calc_error().
+ */
+CALC_API calc_expression* calc_compile(char const* source, size_t length);
+
+/* the reason the expression did not compile, or NULL if it did */
+CALC_API char const* calc_error(calc_expression const* expression);
+
+/*
+ * The variables the expression reads. Evaluation takes their values in this
+ * order; names stay valid until the expression is freed.
+ */
+CALC_API size_t calc_variable_count(calc_expression const* expression);
+CALC_API char const* calc_variable_name(calc_expression const* expression, size_t index);
+
+/* evaluates the expression with variables[i] as the value of variable i */
+CALC_API calc_status calc_evaluate(calc_expression const* expression, double const* variables, double* result);
+
+/*
+ * Evaluates the expression for `rows` rows at once: columns[i][row] is the
+ * value of variable i in that row and the result goes to results[row].
+ */
+CALC_API calc_status calc_evaluate_columns(calc_expression const* expression, double const* const* columns, size_t rows,
+    double* results);
+
+CALC_API void calc_free(calc_expression* expression);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,91 @@
+/*
+ * Cost of calling the calculator through its C interface: the bare call,
+ * compiling, evaluating one row per call, and evaluating many rows per call.
+ */
+
+#include "calculator_api.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* the results end up here, so the optimizer can't drop the calls producing them */
+static volatile double sink;
+
+static double
+now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+int
+main(void) {
+    static char const source[] = "(x + 1) * y - x / 3";
+    enum { calls = 10000000, compiles = 200000, rows = 1 << 20 };
+
+    calc_expression* expression = calc_compile(source, strlen(source));
+    if (!expression || calc_error(expression)) {
+        fprintf(stderr, "%s\n", expression ? calc_error(expression) : "out of memory");
+        return 1;
+    }
+
+    double total = 0;
+
+    double start = now();
+    for (int i = 0; i < calls; i++) {
+        total += (double)calc_variable_count(expression);
+    }
+    printf("calc_variable_count    %6.1f ns per call\n", (now() - start) / calls * 1e9);
+
+    start = now();
+    for (int i = 0; i < compiles; i++) {
+        calc_expression* compiled = calc_compile(source, strlen(source));
+        total += (double)calc_variable_count(compiled);
+        calc_free(compiled);
+    }
+    printf("calc_compile           %6.1f ns per call\n", (now() - start) / compiles * 1e9);
+
+    double variables[2] = { 1, 2 };
+    start = now();
+    for (int i = 0; i < calls; i++) {
+        double result;
+        variables[0] = i;
+        calc_evaluate(expression, variables, &result);
+        total += result;
+    }
+    printf("calc_evaluate          %6.1f ns per call\n", (now() - start) / calls * 1e9);
+
+    double* x = malloc(rows * sizeof(double));
+    double* y = malloc(rows * sizeof(double));
+    double* results = malloc(rows * sizeof(double));
+    for (int i = 0; i < rows; i++) {
+        x[i] = i;
+        y[i] = 2;
+    }
+    double const* columns[2] = { x, y };
+
+    start = now();
+    for (int i = 0; i < calls / 10; i++) {
+        double const* row[2] = { x + i % rows, y + i % rows };
+        calc_evaluate_columns(expression, row, 1, results);
+        total += results[0];
+    }
+    printf("calc_evaluate_columns  %6.1f ns per call of 1 row\n", (now() - start) / (calls / 10) * 1e9);
+
+    start = now();
+    for (int i = 0; i < 20; i++) {
+        calc_evaluate_columns(expression, columns, rows, results);
+        total += results[rows - 1];
+    }
+    printf("calc_evaluate_columns  %6.2f ns per row, %d rows per call\n", (now() - start) / (20.0 * rows) * 1e9, rows);
+
+    free(x);
+    free(y);
+    free(results);
+    calc_free(expression);
+
+    sink = total;
+    return 0;
+}
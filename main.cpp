@@ -1,338 +1,3366 @@
 #pragma warning(disable: 26812 26495)
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdarg>
+#include <chrono>
 #include <cmath>
-#include <iostream>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <deque>
 #include <string>
 #include <exception>
+#include <functional>
+#include <limits>
+#include <new>
+#include <random>
 #include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#ifdef __linux__
+#include <dirent.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+#include "calculator.h"
+
+// the REPL and batch modes read and write file descriptors directly through
+// their own buffers, instead of going through iostreams
+#ifdef _WIN32
+static long long read_some(int fd, char* data, size_t size) { return _read(fd, data, (unsigned)size); }
+static long long write_some(int fd, char const* data, size_t size) { return _write(fd, data, (unsigned)size); }
+static long long seek_file(int fd, long long offset, int whence) { return _lseeki64(fd, offset, whence); }
+static int close_file(int fd) { return _close(fd); }
+static bool is_terminal(int fd) { return _isatty(fd) != 0; }
+#else
+static long long read_some(int fd, char* data, size_t size) { return ::read(fd, data, size); }
+static long long write_some(int fd, char const* data, size_t size) { return ::write(fd, data, size); }
+static long long seek_file(int fd, long long offset, int whence) { return (long long)lseek(fd, (off_t)offset, whence); }
+static int close_file(int fd) { return ::close(fd); }
+static bool is_terminal(int fd) { return isatty(fd) != 0; }
+#endif
+
+#if defined(__GNUC__)
+#define PRINTF_LIKE(string, first) __attribute__((format(printf, string, first)))
+#else
+#define PRINTF_LIKE(string, first)
+#endif
+
+// splits input into lines, reading it from a file descriptor a block at a
+// time or taking it from memory that is already loaded. A line is only valid
+// until the next call to next().
+struct LineReader {
+
+    static constexpr size_t block = 1 << 16;
+
+    int fd = -1;
+    std::vector<char> buffer;
+    char const* cursor = nullptr;
+    char const* end = nullptr;
+
+    // input offset of `cursor`
+    long long position = 0;
+
+    // reads from `fd`, starting at input offset `start`
+    explicit LineReader(int descriptor, long long start = 0) : fd(descriptor), position(start) {}
+
+    // reads the `size` bytes at `data`, which are at input offset `start`
+    LineReader(char const* data, size_t size, long long start) : cursor(data), end(data + size), position(start) {}
+
+    // true if next() can return a whole line without reading
+    bool has_line() const {
+        return cursor != end && memchr(cursor, '\n', (size_t)(end - cursor)) != nullptr;
+    }
+
+    bool next(std::string_view& line) {
+        char const* newline = (char const*)memchr(cursor, '\n', (size_t)(end - cursor));
+
+        while (!newline && fd >= 0) {
+            // keep the partial line and read more behind it
+            size_t kept = (size_t)(end - cursor);
+            size_t offset = cursor == end ? 0 : (size_t)(cursor - buffer.data());
+            if (offset > 0) memmove(buffer.data(), cursor, kept);
+            if (buffer.size() < kept + block) buffer.resize(kept + block);
+
+            long long n;
+            do {
+                n = read_some(fd, buffer.data() + kept, buffer.size() - kept);
+            } while (n < 0 && errno == EINTR);
+
+            cursor = buffer.data();
+            end = cursor + kept + (n > 0 ? n : 0);
+
+            if (n <= 0) {
+                fd = -1;
+                break;
+            }
+
+            newline = (char const*)memchr(cursor + kept, '\n', (size_t)n);
+        }
+
+        if (!newline) {
+            // like std::getline, a last line without a newline still counts
+            if (cursor == end) return false;
+            newline = end;
+        }
+
+        line = std::string_view(cursor, (size_t)(newline - cursor));
+        char const* next_line = newline == end ? end : newline + 1;
+        position += next_line - cursor;
+        cursor = next_line;
+        return true;
+    }
+};
+
+// buffers output for a file descriptor. By default the buffer is its own,
+// but it can be given memory, such as huge pages, to use instead.
+struct LineWriter {
+
+    int fd;
+    std::vector<char> owned;
+    char* data;
+    size_t capacity;
+    size_t size = 0;
+    bool failed = false;
+
+    explicit LineWriter(int descriptor, char* memory = nullptr, size_t length = 0) : fd(descriptor) {
+        if (!memory) {
+            owned.resize(1 << 16);
+            memory = owned.data();
+            length = owned.size();
+        }
+
+        data = memory;
+        capacity = length;
+    }
+
+    LineWriter(LineWriter const&) = delete;
+    LineWriter& operator=(LineWriter const&) = delete;
+
+    void write(std::string_view bytes) {
+        if (bytes.length() > capacity - size) {
+            flush();
+            if (bytes.length() >= capacity) {
+                write_all(bytes.data(), bytes.length());
+                return;
+            }
+        }
+
+        memcpy(data + size, bytes.data(), bytes.length());
+        size += bytes.length();
+    }
+
+    void line(std::string_view text) {
+        write(text);
+        write("\n");
+    }
+
+    // false if anything could not be written, now or before
+    bool flush() {
+        write_all(data, size);
+        size = 0;
+        return !failed;
+    }
+
+    void write_all(char const* bytes, size_t length) {
+        while (length > 0 && !failed) {
+            long long n = write_some(fd, bytes, length);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                failed = true;
+                break;
+            }
+
+            bytes += n;
+            length -= (size_t)n;
+        }
+    }
+};
+
+// where the REPL reads its lines, and whether someone is typing them. Input
+// that comes from a pipe or file gets no prompts.
+struct Console {
+    LineReader input{ 0 };
+    LineWriter output{ 1 };
+    bool interactive = is_terminal(0);
+
+    Console() = default;
+
+    // prints to `descriptor` and never prompts, for testing
+    explicit Console(int descriptor) : output{ descriptor }, interactive(false) {}
+    Console(Console const&) = delete;
+    Console& operator=(Console const&) = delete;
+
+    ~Console() {
+        output.flush();
+    }
+
+    // formats like printf into `output`
+    PRINTF_LIKE(2, 3) void print(char const* format, ...) {
+        char buffer[256];
+
+        va_list arguments;
+        va_start(arguments, format);
+        int length = vsnprintf(buffer, sizeof(buffer), format, arguments);
+        va_end(arguments);
+
+        if (length < 0) return;
+        if ((size_t)length < sizeof(buffer)) {
+            output.write(std::string_view(buffer, (size_t)length));
+            return;
+        }
+
+        std::string text((size_t)length + 1, '\0');
+        va_start(arguments, format);
+        vsnprintf(&text[0], text.size(), format, arguments);
+        va_end(arguments);
+        output.write(std::string_view(text.data(), (size_t)length));
+    }
+
+    // output is only flushed before waiting for input, so that answers to
+    // piped lines go out in large writes while a terminal still sees every
+    // answer before its next prompt
+    bool read_line(char const* prompt, std::string& line) {
+        if (interactive) output.write(prompt);
+        if (!input.has_line()) output.flush();
+
+        std::string_view text;
+        if (!input.next(text)) return false;
+
+        line.assign(text);
+        return true;
+    }
+};
+
+// evaluates a program over many independent time series at once, one time
+// step per call to step(). The recent history of every input is kept in a ring
+// buffer and every rolling window keeps a running total, so a step costs O(1)
+// per window whatever its length. Until enough steps have been seen, lags read
+// as NaN and rolling windows cover only the steps so far. Running totals are
+// updated by adding and subtracting, so they can drift by a few ulps. A NaN or
+// infinite input makes its windows NaN or infinite only while it is in them:
+// a total that is not finite can't have values subtracted from it, so it is
+// summed again from the history instead, which costs O(window) per step until
+// the value has left.
+struct SeriesEvaluator {
+
+    struct History {
+        size_t capacity;
+        std::vector<double> values;
+    };
+
+    Program program;
+    size_t series;
+
+    // slots of the variables read by the program, in the order step() takes
+    // their columns; the program's loads and windows refer to these indices
+    std::vector<uint32_t> inputs;
+    std::vector<History> history;
+
+    std::vector<std::vector<double>> totals;
+    std::vector<std::vector<double>> means;
+    std::vector<double> missing;
+    std::vector<double> stack;
+
+    size_t steps = 0;
+
+    SeriesEvaluator(Program p, size_t series_count) : program(std::move(p)), series(series_count) {
+        std::unordered_map<uint32_t, uint32_t> input_index;
+
+        auto input = [&](uint32_t slot, size_t capacity) {
+            auto inserted = input_index.emplace(slot, (uint32_t)inputs.size());
+            if (inserted.second) {
+                inputs.push_back(slot);
+                history.push_back(History{ 1, {} });
+            }
+
+            History& h = history[inserted.first->second];
+            h.capacity = capacity > h.capacity ? capacity : h.capacity;
+            return inserted.first->second;
+        };
+
+        totals.resize(program.windows.size());
+        means.resize(program.windows.size());
+
+        for (auto& instruction : program.code) {
+            if (instruction.op == OpCode::LOAD_VARIABLE) {
+                instruction.operand = input(instruction.operand, 1);
+            }
+
+            if (instruction.op == OpCode::ROLLING_SUM || instruction.op == OpCode::ROLLING_MEAN) {
+                totals[instruction.operand].resize(series);
+            }
+
+            if (instruction.op == OpCode::ROLLING_MEAN) {
+                means[instruction.operand].resize(series);
+            }
+        }
+
+        for (auto& window : program.windows) {
+            window.slot = input(window.slot, (size_t)window.length + 1);
+        }
+
+        for (auto& h : history) {
+            h.values.resize(h.capacity * series);
+        }
+
+        missing.resize(series, NAN);
+    }
+
+    double* row(uint32_t input, size_t step) {
+        History& h = history[input];
+        return &h.values[(step % h.capacity) * series];
+    }
+
+    // the sum of the window's values for series `s`, from the history
+    double window_sum(Window window, size_t s) {
+        double sum = 0;
+        for (size_t i = 0; i < window.length; i++) sum += row(window.slot, steps - i)[s];
+        return sum;
+    }
+
+    // `columns[i]` holds this step's value of inputs[i] for every series
+    void step(double const* const* columns, double* out) {
+        for (size_t i = 0; i < inputs.size(); i++) {
+            std::copy(columns[i], columns[i] + series, row((uint32_t)i, steps));
+        }
+
+        for (size_t w = 0; w < program.windows.size(); w++) {
+            if (totals[w].empty()) continue;
+
+            Window window = program.windows[w];
+            double* total = totals[w].data();
+            double const* added = row(window.slot, steps);
+
+            if (steps >= window.length) {
+                double const* removed = row(window.slot, steps - window.length);
+                for (size_t s = 0; s < series; s++) {
+                    total[s] = std::isfinite(total[s]) && std::isfinite(removed[s])
+                        ? total[s] + (added[s] - removed[s])
+                        : window_sum(window, s);
+                }
+            } else {
+                for (size_t s = 0; s < series; s++) total[s] += added[s];
+            }
+
+            if (!means[w].empty()) {
+                double count = (double)(steps < window.length ? steps + 1 : window.length);
+                for (size_t s = 0; s < series; s++) means[w][s] = total[s] / count;
+            }
+        }
+
+        evaluate_columns(program, series, [&](Instruction instruction) -> double const* {
+            switch (instruction.op) {
+                case OpCode::LOAD_VARIABLE: return columns[instruction.operand];
+                case OpCode::ROLLING_SUM: return totals[instruction.operand].data();
+                case OpCode::ROLLING_MEAN: return means[instruction.operand].data();
+                default: {
+                    Window window = program.windows[instruction.operand];
+                    return steps < window.length ? missing.data() : row(window.slot, steps - window.length);
+                }
+            }
+        }, stack, out);
+
+        steps++;
+    }
+};
+
+// named formulas (spreadsheet cells) that are recomputed lazily: redefining a
+// formula only marks the formulas that depend on it as dirty, and reading a
+// value recomputes just the dirty formulas it depends on, in dependency order
+struct FormulaGraph {
+
+    struct Node {
+        Program program;
+        std::vector<uint32_t> dependencies;
+        std::vector<uint32_t> dependents;
+        double value = 0;
+        bool defined = false;
+        bool dirty = false;
+    };
+
+    SymbolTable symbols;
+    std::vector<Node> nodes;
+    Limits limits;
+    Engine engine = Engine::CLIMBING;
+
+    // the program of the last expression evaluated, whose vectors the next
+    // one is compiled into so that evaluating lines stops allocating
+    Program scratch;
+
+    uint32_t slot(std::string_view name) {
+        uint32_t s = symbols.intern(name);
+        nodes.resize(symbols.names.size());
+        return s;
+    }
+
+    // compiles the rest of `lexer` as the new formula for `name`
+    void define(std::string_view name, Lexer lexer) {
+        Program program = optimize(compile(engine, lexer, symbols, limits));
+
+        uint32_t target = slot(name);
+
+        std::vector<uint32_t> dependencies;
+        for (auto const& instruction : program.code) {
+            if (instruction.op == OpCode::LOAD_VARIABLE
+                && std::find(dependencies.begin(), dependencies.end(), instruction.operand) == dependencies.end()) {
+                dependencies.push_back(instruction.operand);
+            }
+        }
+
+        if (depends_on(dependencies, target)) {
+            throw EvaluationException("Circular reference: " + std::string(name));
+        }
+
+        Node& node = nodes[target];
+
+        for (uint32_t dependency : node.dependencies) {
+            auto& dependents = nodes[dependency].dependents;
+            auto found = std::find(dependents.begin(), dependents.end(), target);
+            *found = dependents.back();
+            dependents.pop_back();
+        }
+
+        for (uint32_t dependency : dependencies) {
+            nodes[dependency].dependents.push_back(target);
+        }
+
+        node.program = std::move(program);
+        node.dependencies = std::move(dependencies);
+        node.defined = true;
+
+        mark_dirty(target);
+    }
+
+    // true if one of `dependencies` is `target` or depends on it; walks the
+    // dependents of `target`, which is usually much smaller than its inputs
+    bool depends_on(std::vector<uint32_t> const& dependencies, uint32_t target) const {
+        std::vector<uint32_t> pending{ target };
+        std::unordered_set<uint32_t> visited;
+
+        while (!pending.empty()) {
+            uint32_t s = pending.back();
+            pending.pop_back();
+
+            if (std::find(dependencies.begin(), dependencies.end(), s) != dependencies.end()) return true;
+            if (!visited.insert(s).second) continue;
+
+            for (uint32_t dependent : nodes[s].dependents) {
+                pending.push_back(dependent);
+            }
+        }
+
+        return false;
+    }
+
+    // a dirty node's dependents are always dirty too, so the walk can stop
+    // at nodes that are already marked
+    void mark_dirty(uint32_t s) {
+        std::vector<uint32_t> pending{ s };
+
+        while (!pending.empty()) {
+            Node& node = nodes[pending.back()];
+            pending.pop_back();
+
+            if (node.dirty) continue;
+            node.dirty = true;
+
+            for (uint32_t dependent : node.dependents) {
+                pending.push_back(dependent);
+            }
+        }
+    }
+
+    double value(uint32_t s) {
+        if (!nodes[s].dirty) {
+            return defined_value(s);
+        }
+
+        std::vector<uint32_t> pending{ s };
+
+        while (!pending.empty()) {
+            Node& node = nodes[pending.back()];
+
+            if (!node.dirty) {
+                pending.pop_back();
+                continue;
+            }
+
+            bool ready = true;
+            for (uint32_t dependency : node.dependencies) {
+                if (nodes[dependency].dirty) {
+                    pending.push_back(dependency);
+                    ready = false;
+                }
+            }
+
+            if (!ready) continue;
+
+            node.value = evaluate(node.program, [this](uint32_t dependency) {
+                return defined_value(dependency);
+            }, limits.max_instructions);
+            node.dirty = false;
+            pending.pop_back();
+        }
+
+        return defined_value(s);
+    }
+
+    double defined_value(uint32_t s) const {
+        if (!nodes[s].defined) {
+            throw EvaluationException(std::string(undefined_variable_error, strlen(undefined_variable_error) - 1) + symbols.names[s]);
+        }
+
+        return nodes[s].value;
+    }
+
+    bool lookup(std::string_view name, double& result) {
+        uint32_t s;
+        if (!symbols.find(name, s) || s >= nodes.size() || !nodes[s].defined) {
+            return false;
+        }
+
+        result = value(s);
+        return true;
+    }
+
+    // compiles `lexer` with the selected engine and evaluates it over the
+    // current formulas, without defining anything
+    double evaluate_expression(Lexer lexer) {
+        scratch = compile(engine, lexer, symbols, limits, nullptr, false, std::move(scratch));
+        nodes.resize(symbols.names.size());
+
+        return evaluate(scratch, [this](uint32_t s) {
+            return value(s);
+        }, limits.max_instructions);
+    }
+};
+
+// a what-if view of a FormulaGraph. Overridden formulas and the formulas that
+// depend on them get their own entries, computed lazily; everything else is
+// read through from the shared graph, so a scenario costs memory in proportion
+// to what it changes rather than to the size of the graph. Copying a scenario
+// copies only those entries, so scenarios can be derived from each other.
+// Entries are not invalidated when the graph itself is redefined.
+struct Scenario {
+
+    struct Entry {
+        double value;
+        bool computed;
+        bool overridden;
+    };
+
+    FormulaGraph* base;
+    std::unordered_map<uint32_t, Entry> entries;
+
+    Scenario(FormulaGraph& graph) : base(&graph) {}
+
+    void set(uint32_t slot, double value) {
+        entries[slot] = Entry{ value, true, true };
+
+        std::vector<uint32_t> pending(base->nodes[slot].dependents);
+
+        while (!pending.empty()) {
+            uint32_t s = pending.back();
+            pending.pop_back();
+
+            auto found = entries.find(s);
+            if (found != entries.end() && (found->second.overridden || !found->second.computed)) continue;
+
+            entries[s] = Entry{ 0, false, false };
+
+            for (uint32_t dependent : base->nodes[s].dependents) {
+                pending.push_back(dependent);
+            }
+        }
+    }
+
+    double read(uint32_t s) {
+        auto found = entries.find(s);
+        return found == entries.end() ? base->value(s) : found->second.value;
+    }
+
+    double value(uint32_t slot) {
+        auto entry = entries.find(slot);
+        if (entry == entries.end() || entry->second.computed) {
+            return entry == entries.end() ? base->value(slot) : entry->second.value;
+        }
+
+        std::vector<uint32_t> pending{ slot };
+
+        while (!pending.empty()) {
+            uint32_t s = pending.back();
+
+            auto found = entries.find(s);
+            if (found == entries.end() || found->second.computed) {
+                pending.pop_back();
+                continue;
+            }
+
+            auto const& node = base->nodes[s];
+
+            bool ready = true;
+            for (uint32_t dependency : node.dependencies) {
+                auto entry = entries.find(dependency);
+                if (entry != entries.end() && !entry->second.computed) {
+                    pending.push_back(dependency);
+                    ready = false;
+                }
+            }
+
+            if (!ready) continue;
+
+            double value = evaluate(node.program, [this](uint32_t dependency) {
+                return read(dependency);
+            }, base->limits.max_instructions);
+
+            entries[s] = Entry{ value, true, false };
+            pending.pop_back();
+        }
+
+        return read(slot);
+    }
+
+    bool lookup(std::string_view name, double& result) {
+        uint32_t s;
+        if (!base->symbols.find(name, s) || s >= base->nodes.size()) {
+            return false;
+        }
+
+        auto found = entries.find(s);
+        if (found == entries.end() && !base->nodes[s].defined) {
+            return false;
+        }
+
+        result = value(s);
+        return true;
+    }
+};
+
+// splits `a = 1; b = a * 2; expression`, calling bind(name, lexer) for each
+// binding with the lexer positioned after the '=', and returns the expression
+template <typename Bind>
+static std::string_view
+split_bindings(std::string_view line, Bind bind) {
+    for (;;) {
+        size_t end = line.find(';');
+
+        if (end == std::string_view::npos) {
+            return line;
+        }
+
+        Lexer lexer{ line.substr(0, end) };
+
+        Token name = lexer.next_token();
+        if (name.type != TokenType::IDENTIFIER || lexer.next_token().type != TokenType::ASSIGN) {
+            throw EvaluationException("Expected 'name = expression' before ';'");
+        }
+
+        bind(name.string, lexer);
+
+        line = line.substr(end + 1);
+    }
+}
+
+// `a = 1; b = a * 2; expression` evaluates expression as if the named formulas
+// had the given values, without changing them
+static double
+evaluate_scenario(FormulaGraph& formulas, std::string_view line) {
+    Scenario scenario(formulas);
+
+    auto resolve = [&scenario](std::string_view name, double& value) {
+        return scenario.lookup(name, value);
+    };
+
+    auto expression = split_bindings(line, [&](std::string_view name, Lexer lexer) {
+        Parser parser(lexer);
+        parser.limits = formulas.limits;
+        parser.resolve_variable = resolve;
+        scenario.set(formulas.slot(name), parser.parse());
+    });
+
+    Parser parser{ Lexer(expression) };
+    parser.limits = formulas.limits;
+    parser.resolve_variable = resolve;
+    return parser.parse();
+}
+
+// `a = 1; b = 2; expression` compiles expression with a and b fixed to the
+// given values
+static Program
+specialize_line(FormulaGraph& formulas, std::string_view line) {
+    std::unordered_map<uint32_t, double> bindings;
+
+    auto expression = split_bindings(line, [&](std::string_view name, Lexer lexer) {
+        Parser parser(lexer);
+        parser.limits = formulas.limits;
+        parser.resolve_variable = [&formulas](std::string_view name, double& value) {
+            return formulas.lookup(name, value);
+        };
+        bindings[formulas.slot(name)] = parser.parse();
+    });
+
+    Compiler compiler(Lexer(expression), formulas.symbols);
+    compiler.limits = formulas.limits;
+    return specialize(compiler.compile(), bindings);
+}
+
+// `:series expression` reads one time step per line, the values of the
+// expression's variables in the order printed, until an empty line
+static void
+run_series(FormulaGraph& formulas, Console& console, std::string_view expression) {
+    Compiler compiler(Lexer(expression), formulas.symbols);
+    compiler.limits = formulas.limits;
+    SeriesEvaluator evaluator(optimize(compiler.compile()), 1);
+
+    console.print(" inputs:");
+    for (uint32_t slot : evaluator.inputs) {
+        console.print(" %s", formulas.symbols.names[slot].c_str());
+    }
+    console.print("\n");
+
+    std::string line;
+    std::vector<double> values(evaluator.inputs.size());
+    std::vector<double const*> columns(values.size());
+
+    for (size_t i = 0; i < values.size(); i++) {
+        columns[i] = &values[i];
+    }
+
+    for (;;) {
+        if (!console.read_line("| ", line) || line.empty()) {
+            break;
+        }
+
+        char const* cursor = line.c_str();
+        size_t count = 0;
+
+        for (; count < values.size(); count++) {
+            char* end;
+            values[count] = std::strtod(cursor, &end);
+            if (end == cursor) break;
+            cursor = end;
+        }
+
+        if (count < values.size()) {
+            console.print("Expected %zu values\n", values.size());
+            continue;
+        }
+
+        double value;
+        evaluator.step(columns.data(), &value);
+        console.print(" = %g\n", value);
+    }
+}
+
+// `:check expression` reports every error in expression rather than just the
+// first one
+static void
+check_line(FormulaGraph& formulas, Console& console, std::string_view expression) {
+    Parser parser{ Lexer(expression) };
+    parser.limits = formulas.limits;
+    parser.resolve_variable = [&formulas](std::string_view name, double& value) {
+        return formulas.lookup(name, value);
+    };
+
+    auto diagnostics = parser.check();
+    if (diagnostics.empty()) {
+        console.print(" ok\n");
+        return;
+    }
+
+    for (auto const& diagnostic : diagnostics) {
+        console.print("%s%s\n", diagnostic.message, parser.show_error_location(diagnostic.offset).c_str());
+    }
+}
+
+// `:profile expression`: times each part of the expression over repeated
+// evaluations and prints where the time went, then the same as folded stacks
+// for flame graph tools
+static void
+profile_line(FormulaGraph& formulas, Console& console, std::string_view expression) {
+    static constexpr double seconds = 0.25;
+
+    std::vector<SourceSpan> spans;
+    Program program = compile(formulas.engine, Lexer(expression), formulas.symbols, formulas.limits, &spans);
+    formulas.nodes.resize(formulas.symbols.names.size());
+
+    Profile found = profile(program, spans, expression, [&formulas](uint32_t s) {
+        return formulas.value(s);
+    }, seconds, formulas.limits.max_instructions);
+
+    console.print("%s", annotate_profile(found, expression).c_str());
+    console.print(" folded stacks:\n%s", folded_stacks(found, expression).c_str());
+}
+
+// `:limit tokens 1000`, `:limit depth 64`, `:limit instructions 100000` or
+// `:limit window 1000`
+static void
+set_limit(Limits& limits, std::string_view line) {
+    Lexer lexer(line);
+    Token name = lexer.next_token();
+    Token value = lexer.next_token();
+
+    if (name.type != TokenType::IDENTIFIER || value.type != TokenType::NUMBER
+        || lexer.next_token().type != TokenType::END_OF_FILE) {
+        throw EvaluationException("Expected ':limit tokens|depth|instructions|window <number>'");
+    }
+
+    // anything from 1 up to 2^53, the largest count a double holds exactly
+    double number = token_to_number(value);
+    if (!(number >= 1 && number <= 9007199254740992.0) || number != floor(number)) {
+        throw EvaluationException("Limit must be a whole number from 1 to 2^53");
+    }
+
+    if (name.string == "tokens") {
+        limits.max_tokens = (size_t)number;
+    } else if (name.string == "depth") {
+        limits.max_depth = (size_t)number;
+    } else if (name.string == "instructions") {
+        limits.max_instructions = (size_t)number;
+    } else if (name.string == "window") {
+        limits.max_window = (size_t)number;
+    } else {
+        throw EvaluationException("Unknown limit: " + std::string(name.string));
+    }
+}
+
+// evaluates or runs one line typed at the REPL and prints the outcome
+static void
+run_line(FormulaGraph& formulas, Console& console, std::string const& s) {
+    char buffer[64] = {0};
+
+    Lexer lexer(s);
+
+    try {
+        if (s.rfind(":with ", 0) == 0) {
+            auto value = evaluate_scenario(formulas, std::string_view(s).substr(6));
+            snprintf(buffer, sizeof(buffer), "%g", value);
+            console.print(" = %s\n", buffer);
+            return;
+        }
+
+        if (s.rfind(":limit ", 0) == 0) {
+            set_limit(formulas.limits, std::string_view(s).substr(7));
+            return;
+        }
+
+        if (s.rfind(":engine ", 0) == 0) {
+            std::string_view name = std::string_view(s).substr(8);
+            if (!parse_engine(name, formulas.engine)) {
+                throw EvaluationException("Unknown engine: " + std::string(name));
+            }
+            return;
+        }
+
+        if (s.rfind(":encode ", 0) == 0) {
+            std::string_view expression = std::string_view(s).substr(8);
+            std::string encoded = encode_program(compile(formulas.engine, Lexer(expression), formulas.symbols, formulas.limits), formulas.symbols);
+
+            console.print(" %zu bytes (%zu as text):", encoded.size(), expression.length());
+            for (unsigned char byte : encoded) console.print(" %02x", byte);
+            console.print("\n");
+            return;
+        }
+
+        if (s.rfind(":rpn ", 0) == 0) {
+            SymbolTable& symbols = formulas.symbols;
+            Program program = compile(formulas.engine, Lexer(std::string_view(s).substr(5)), symbols, formulas.limits);
+            console.print(" %s\n", to_rpn(program, symbols).c_str());
+            return;
+        }
+
+        if (s.rfind(":profile ", 0) == 0) {
+            profile_line(formulas, console, std::string_view(s).substr(9));
+            return;
+        }
+
+        if (s.rfind(":check ", 0) == 0) {
+            check_line(formulas, console, std::string_view(s).substr(7));
+            return;
+        }
+
+        if (s.rfind(":series ", 0) == 0) {
+            run_series(formulas, console, std::string_view(s).substr(8));
+            return;
+        }
+
+        if (s.rfind(":specialize ", 0) == 0) {
+            auto program = specialize_line(formulas, std::string_view(s).substr(12));
+            console.print("%s", format_program(program, formulas.symbols).c_str());
+            return;
+        }
+
+        // `name = expression` (re)defines a named formula
+        Lexer definition(lexer);
+        Token name = definition.next_token();
+        if (name.type == TokenType::IDENTIFIER && definition.next_token().type == TokenType::ASSIGN) {
+            formulas.define(name.string, definition);
+
+            auto value = formulas.value(formulas.slot(name.string));
+            snprintf(buffer, sizeof(buffer), "%g", value);
+            console.print(" %.*s = %s\n", (int)name.string.length(), name.string.data(), buffer);
+            return;
+        }
+
+        if (formulas.engine != Engine::CLIMBING) {
+            auto value = formulas.evaluate_expression(lexer);
+            snprintf(buffer, sizeof(buffer), "%g", value);
+            console.print(" = %s\n", buffer);
+            return;
+        }
+
+        Parser parser(lexer);
+        parser.limits = formulas.limits;
+        parser.resolve_variable = [&formulas](std::string_view name, double& value) {
+            return formulas.lookup(name, value);
+        };
+
+        auto value = parser.parse();
+        snprintf(buffer, sizeof(buffer), "%g", value);
+        console.print(" = %s\n", buffer);
+
+    } catch (Parser::ParserException& e) {
+        console.print("%s\n", e.what());
+    } catch (EvaluationException& e) {
+        console.print("%s\n", e.what());
+    } catch (std::bad_alloc&) {
+        console.print("Out of memory\n");
+    } catch (std::exception& e) {
+        console.print("%s\n", e.what());
+    }
+}
+
+// number of operator new calls so far, for `--count-allocations`, the
+// `:allocations` REPL toggle and `--self-test`. Evaluating an expression
+// should not allocate once the buffers it reuses have grown to size.
+static std::atomic<size_t> allocation_count{ 0 };
+
+// the replacements are kept out of line so that the compiler never pairs an
+// inlined free() with the operator new it sees at the call site
+#if defined(__GNUC__)
+#define ALLOCATION_FUNCTION __attribute__((noinline))
+#else
+#define ALLOCATION_FUNCTION
+#endif
+
+ALLOCATION_FUNCTION void* operator new(size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+ALLOCATION_FUNCTION void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+ALLOCATION_FUNCTION void* operator new(size_t size, std::align_val_t alignment) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+
+    // aligned_alloc wants a size that is a multiple of the alignment
+    size_t align = (size_t)alignment;
+    size_t rounded = size ? (size + align - 1) / align * align : align;
+#ifdef _WIN32
+    if (void* p = _aligned_malloc(rounded, align)) return p;
+#else
+    if (void* p = aligned_alloc(align, rounded)) return p;
+#endif
+    throw std::bad_alloc();
+}
+
+ALLOCATION_FUNCTION void* operator new[](size_t size, std::align_val_t alignment) {
+    return operator new(size, alignment);
+}
+
+ALLOCATION_FUNCTION void operator delete(void* p) noexcept {
+    free(p);
+}
+
+ALLOCATION_FUNCTION void operator delete[](void* p) noexcept {
+    free(p);
+}
+
+ALLOCATION_FUNCTION void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+ALLOCATION_FUNCTION void operator delete[](void* p, size_t) noexcept {
+    free(p);
+}
+
+ALLOCATION_FUNCTION void operator delete(void* p, std::align_val_t) noexcept {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+ALLOCATION_FUNCTION void operator delete[](void* p, std::align_val_t alignment) noexcept {
+    operator delete(p, alignment);
+}
+
+ALLOCATION_FUNCTION void operator delete(void* p, size_t, std::align_val_t alignment) noexcept {
+    operator delete(p, alignment);
+}
+
+ALLOCATION_FUNCTION void operator delete[](void* p, size_t, std::align_val_t alignment) noexcept {
+    operator delete(p, alignment);
+}
+
+// batch results keyed by expression text. Batch lines have no variables, so
+// a line's result depends only on its text and identical lines, which batch
+// input tends to be full of, need to be evaluated only once.
+struct ResultCache {
+
+    static constexpr size_t max_entries = 1 << 16;
+
+    std::unordered_map<std::string, std::string> results;
+
+    std::string const* find(std::string const& expression) const {
+        auto found = results.find(expression);
+        return found == results.end() ? nullptr : &found->second;
+    }
+
+    void insert(std::string const& expression, std::string result) {
+        if (results.size() >= max_entries) {
+            results.clear();
+        }
+
+        results.emplace(expression, std::move(result));
+    }
+};
+
+#ifndef _WIN32
+// a fixed-size open-addressing table of batch results in a memory-mapped
+// file, shared by every batch process that opens the same path. Slots are
+// claimed with a compare-and-swap and published with a release store once
+// their value is written, so no locks are needed; a process that dies while
+// inserting leaves a slot that stays pending, which only ever reads as a miss.
+// Expressions are identified by two independent 64-bit hashes of their text
+// and a context: the engine and limits they were evaluated under, so one
+// engine never reads a value another one stored for a line it rejects.
+struct SharedResultCache {
+
+    static constexpr uint64_t magic = 0x50434341434845ull;
+    static constexpr size_t capacity = 1 << 20;
+    static constexpr size_t max_probes = 16;
+    static constexpr uint64_t pending = 1ull << 63;
+
+    struct Slot {
+        std::atomic<uint64_t> key;
+        std::atomic<uint64_t> check;
+        std::atomic<uint64_t> value;
+    };
+
+    struct Header {
+        std::atomic<uint64_t> magic;
+        uint64_t capacity;
+    };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "slots must be lock-free to be shared between processes");
+
+    Header* header = nullptr;
+    Slot* slots = nullptr;
+
+    ~SharedResultCache() {
+        if (header) {
+            munmap(header, sizeof(Header) + capacity * sizeof(Slot));
+        }
+    }
+
+    // maps the table at `path`, creating it zero-filled (empty) if needed
+    bool open(char const* path) {
+        size_t size = sizeof(Header) + capacity * sizeof(Slot);
+
+        int fd = ::open(path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0) return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || ((size_t)st.st_size < size && ftruncate(fd, (off_t)size) != 0)) {
+            close(fd);
+            return false;
+        }
+
+        void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (memory == MAP_FAILED) return false;
+
+        header = (Header*)memory;
+        slots = (Slot*)(header + 1);
+
+        uint64_t expected = 0;
+        if (!header->magic.compare_exchange_strong(expected, magic)) {
+            if (expected != magic) return false;
+        } else {
+            header->capacity = capacity;
+        }
+
+        return true;
+    }
+
+    static void hash(uint64_t context, std::string const& expression, uint64_t& key, uint64_t& check) {
+        uint64_t h1 = 0xcbf29ce484222325ull;
+        uint64_t h2 = 0x9e3779b97f4a7c15ull;
+
+        auto add = [&](unsigned char c) {
+            h1 = (h1 ^ c) * 0x100000001b3ull;
+            h2 = (h2 + c) * 0xff51afd7ed558ccdull;
+            h2 ^= h2 >> 29;
+        };
+
+        for (int i = 0; i < 64; i += 8) add((unsigned char)(context >> i));
+        for (unsigned char c : expression) add(c);
+
+        key = (h1 >> 1) | 1;
+        check = h2;
+    }
+
+    bool find(uint64_t context, std::string const& expression, double& result) const {
+        uint64_t key, check;
+        hash(context, expression, key, check);
+
+        for (size_t probe = 0; probe < max_probes; probe++) {
+            Slot& slot = slots[(key + probe) % capacity];
+            uint64_t k = slot.key.load(std::memory_order_acquire);
+
+            if (k == 0 || k == (key | pending)) return false;
+
+            if (k == key && slot.check.load(std::memory_order_relaxed) == check) {
+                uint64_t bits = slot.value.load(std::memory_order_relaxed);
+                memcpy(&result, &bits, sizeof(result));
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void insert(uint64_t context, std::string const& expression, double result) {
+        uint64_t key, check;
+        hash(context, expression, key, check);
+
+        uint64_t bits;
+        memcpy(&bits, &result, sizeof(bits));
+
+        for (size_t probe = 0; probe < max_probes; probe++) {
+            Slot& slot = slots[(key + probe) % capacity];
+            uint64_t k = 0;
+
+            if (slot.key.compare_exchange_strong(k, key | pending, std::memory_order_acquire)) {
+                slot.check.store(check, std::memory_order_relaxed);
+                slot.value.store(bits, std::memory_order_relaxed);
+                slot.key.store(key, std::memory_order_release);
+                return;
+            }
+
+            if ((k & ~pending) == key && (k & pending || slot.check.load(std::memory_order_relaxed) == check)) {
+                return;
+            }
+        }
+    }
+};
+#else
+// sharing through a memory-mapped file is only implemented for POSIX systems
+struct SharedResultCache {
+    bool open(char const*) { return false; }
+    bool find(uint64_t, std::string const&, double&) const { return false; }
+    void insert(uint64_t, std::string const&, double) {}
+};
+#endif
+
+#ifndef _WIN32
+// how far a batch job has got: everything before `input_offset` has been
+// evaluated and its results fill the first `output_offset` bytes of the output.
+// save() makes the output durable before recording it and replaces the
+// checkpoint file with a rename, so after a crash the checkpoint never claims
+// more output than was written, and whatever was written after it is
+// truncated away on resume. The input's path, size and modification time are
+// recorded with the offsets, so a checkpoint is never resumed on another input.
+//
+// For testing, CALCULATOR_CHECKPOINT_CRASH_AFTER=n kills the process with
+// SIGKILL as it is about to take checkpoint n + 1.
+struct Checkpoint {
+
+    static constexpr size_t interval = 1 << 16;
+
+    char const* path = nullptr;
+    long long input_offset = 0;
+    long long output_offset = 0;
+
+    std::string input_path;
+    long long input_size = 0;
+    long long input_mtime = 0;
+
+    long long saves = 0;
+    long long crash_after = -1;
+
+    // records the fingerprint of `input`, false if it cannot be read
+    bool describe(char const* input) {
+        struct stat st;
+        if (stat(input, &st) != 0) return false;
+
+        input_path = input;
+        input_size = (long long)st.st_size;
+        input_mtime = (long long)st.st_mtime;
+
+        char const* crash = getenv("CALCULATOR_CHECKPOINT_CRASH_AFTER");
+        crash_after = crash ? atoll(crash) : -1;
+        return true;
+    }
+
+    // false if there is no checkpoint to resume from. A checkpoint taken of
+    // another input, or of this one before it changed, sets `other_input`.
+    bool load(bool& other_input) {
+        FILE* f = fopen(path, "r");
+        if (!f) return false;
+
+        long long size = -1, mtime = -1;
+        char name[4096] = "";
+        bool ok = fscanf(f, "%lld %lld %lld %lld ", &input_offset, &output_offset, &size, &mtime) == 4
+            && fgets(name, sizeof(name), f) != nullptr;
+        fclose(f);
+
+        name[strcspn(name, "\n")] = '\0';
+        other_input = !ok || size != input_size || mtime != input_mtime || input_path != name;
+        return true;
+    }
+
+    bool save(LineWriter& out, long long input) {
+        if (++saves > crash_after && crash_after >= 0) raise(SIGKILL);
+
+        if (!out.flush() || fsync(out.fd) != 0) return false;
+
+        std::string temporary = std::string(path) + ".tmp";
+
+        FILE* f = fopen(temporary.c_str(), "w");
+        if (!f) return false;
+
+        long long output = (long long)lseek(out.fd, 0, SEEK_CUR);
+        bool ok = fprintf(f, "%lld %lld %lld %lld %s\n", input, output, input_size, input_mtime, input_path.c_str()) > 0
+            && fflush(f) == 0 && fsync(fileno(f)) == 0;
+        ok = fclose(f) == 0 && ok;
+
+        if (!ok || rename(temporary.c_str(), path) != 0) return false;
+
+        input_offset = input;
+        output_offset = output;
+        return true;
+    }
+
+    void remove() {
+        unlink(path);
+    }
+};
+#else
+// checkpoints rely on fsync and atomic rename, which are only used on POSIX
+struct Checkpoint {
+    char const* path = nullptr;
+    long long input_offset = 0;
+    long long output_offset = 0;
+
+    bool describe(char const*) { return true; }
+    bool load(bool&) { return false; }
+    bool save(LineWriter&, long long) { return true; }
+    void remove() {}
+};
+#endif
+
+#ifndef _WIN32
+// anonymous memory for large batch buffers. With `huge_pages` it is backed by
+// explicitly reserved huge pages (MAP_HUGETLB) if the system has any free,
+// and otherwise by transparent huge pages requested with madvise, which cuts
+// the TLB misses of scanning through hundreds of megabytes of input.
+struct LargeBuffer {
+
+    static constexpr size_t huge_page_size = 2 << 20;
+
+    char* data = nullptr;
+    size_t length = 0;
+
+    LargeBuffer() = default;
+    LargeBuffer(LargeBuffer const&) = delete;
+    LargeBuffer& operator=(LargeBuffer const&) = delete;
+
+    ~LargeBuffer() {
+        if (data) {
+            munmap(data, length);
+        }
+    }
+
+    bool allocate(size_t size, bool huge_pages) {
+        length = size == 0 ? 1 : size;
+        void* memory = MAP_FAILED;
+
+        if (huge_pages) {
+            length = (length + huge_page_size - 1) / huge_page_size * huge_page_size;
+#ifdef MAP_HUGETLB
+            memory = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+        }
+
+        if (memory == MAP_FAILED) {
+            memory = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED) return false;
+#ifdef MADV_HUGEPAGE
+            if (huge_pages) {
+                madvise(memory, length, MADV_HUGEPAGE);
+            }
+#endif
+        }
+
+        data = (char*)memory;
+        return true;
+    }
+
+    // fills the buffer from `fd` starting at `offset`
+    bool read(int fd, off_t offset, size_t size) {
+        size_t read_so_far = 0;
+
+        while (read_so_far < size) {
+            ssize_t n = pread(fd, data + read_so_far, size - read_so_far, offset + (off_t)read_so_far);
+            if (n <= 0) return false;
+            read_so_far += (size_t)n;
+        }
+
+        return true;
+    }
+};
+#endif
+
+// what every part of a batch job needs besides its input and output
+struct BatchJob {
+    Limits limits;
+    SharedResultCache* shared = nullptr;
+    Checkpoint* checkpoint = nullptr;
+    bool huge_pages = false;
+    bool count_allocations = false;
+    bool check = false;
+    bool emit_rpn = false;
+    Engine engine = Engine::CLIMBING;
+
+    // what a shared cache entry depends on besides the line itself
+    uint64_t cache_context() const {
+        uint64_t context = (uint64_t)engine;
+        for (size_t limit : { limits.max_tokens, limits.max_depth, limits.max_instructions, limits.max_window }) {
+            context = (context ^ limit) * 0x100000001b3ull;
+        }
+        return context;
+    }
+};
+
+// "ok", or "error: " and every error in the line with the column it is at
+static std::string
+check_batch_line(std::string const& line, BatchJob const& job) {
+    std::vector<Diagnostic> diagnostics;
+
+    // the infix engines share one grammar, so climbing checks for all three
+    if (job.engine == Engine::RPN) {
+        RpnParser parser{ Lexer(line) };
+        parser.limits = job.limits;
+        diagnostics = parser.check();
+    } else {
+        Parser parser{ Lexer(line) };
+        parser.limits = job.limits;
+        diagnostics = parser.check();
+    }
+
+    if (diagnostics.empty()) return "ok";
+
+    std::string result = "error: ";
+    char column[32];
+
+    for (size_t i = 0; i < diagnostics.size(); i++) {
+        std::string_view message = diagnostics[i].message;
+        message = message.substr(0, message.find_last_not_of(" \n") + 1);
+
+        if (i > 0) result += "; ";
+        result += message;
+        snprintf(column, sizeof(column), " column %zu", diagnostics[i].offset + 1);
+        result += column;
+    }
+
+    return result;
+}
+
+// the value, or "error: " and the first line of the error message
+static std::string
+evaluate_batch_line(std::string const& line, BatchJob const& job) {
+    char buffer[64];
+    double value;
+
+    if (job.check) {
+        return check_batch_line(line, job);
+    }
+
+    if (job.emit_rpn) {
+        try {
+            SymbolTable symbols;
+            return to_rpn(compile(job.engine, Lexer(line), symbols, job.limits), symbols);
+        } catch (std::exception& e) {
+            std::string_view message = e.what();
+            return "error: " + std::string(message.substr(0, message.find('\n')));
+        }
+    }
+
+    if (job.shared && job.shared->find(job.cache_context(), line, value)) {
+        snprintf(buffer, sizeof(buffer), "%.17g", value);
+        return buffer;
+    }
+
+    try {
+        if (job.engine == Engine::CLIMBING) {
+            Parser parser{ Lexer(line) };
+            parser.limits = job.limits;
+            value = parser.parse();
+        } else if (job.engine == Engine::RPN) {
+            RpnParser parser{ Lexer(line) };
+            parser.limits = job.limits;
+            value = parser.parse();
+        } else {
+            SymbolTable symbols;
+            Program program = compile(job.engine, Lexer(line), symbols, job.limits, nullptr, true);
+            value = evaluate(program, [](uint32_t) { return 0.0; }, job.limits.max_instructions);
+        }
+
+    } catch (std::exception& e) {
+        std::string_view message = e.what();
+        return "error: " + std::string(message.substr(0, message.find('\n')));
+    }
+
+    if (job.shared) {
+        job.shared->insert(job.cache_context(), line, value);
+    }
+
+    snprintf(buffer, sizeof(buffer), "%.17g", value);
+    return buffer;
+}
+
+// evaluates every line of `in` as an independent expression and writes one
+// result per line to `out`
+static bool
+run_batch(LineReader& in, LineWriter& out, BatchJob const& job) {
+    ResultCache cache;
+    std::string_view text;
+    std::string line;
+    size_t lines = 0;
+    size_t allocations = allocation_count;
+
+    while (in.next(text)) {
+        line.assign(text);
+        std::string const* result = cache.find(line);
+
+        if (!result) {
+            cache.insert(line, evaluate_batch_line(line, job));
+            result = cache.find(line);
+        }
+
+        out.line(*result);
+
+        if (++lines % Checkpoint::interval == 0 && job.checkpoint) {
+            if (!job.checkpoint->save(out, in.position)) return false;
+        }
+    }
+
+    if (job.count_allocations) {
+        allocations = allocation_count - allocations;
+        fprintf(stderr, "%zu allocations for %zu lines (%.2f per line)\n",
+            allocations, lines, lines ? (double)allocations / lines : 0.0);
+    }
+
+    return true;
+}
+
+#ifndef _WIN32
+// a byte range of the batch input that starts and ends on line boundaries
+struct Shard {
+    off_t begin;
+    off_t end;
+    int attempts = 0;
+    bool done = false;
+    std::string output;
+};
+
+// offset of the first line that starts at or after `position`
+static off_t
+next_line_start(int fd, off_t position, off_t size) {
+    if (position == 0) return 0;
+
+    char buffer[4096];
+    position--;
+
+    while (position < size) {
+        ssize_t n = pread(fd, buffer, sizeof(buffer), position);
+        if (n <= 0) return size;
+
+        char const* newline = (char const*)memchr(buffer, '\n', (size_t)n);
+        if (newline) return position + (newline - buffer) + 1;
+
+        position += n;
+    }
+
+    return size;
+}
+
+// splits the input from `start`, which must be the start of a line
+static std::vector<Shard>
+split_into_shards(int fd, off_t start, off_t size, size_t count) {
+    std::vector<Shard> shards;
+    off_t begin = start;
+
+    for (size_t i = 1; i <= count && begin < size; i++) {
+        off_t end = i == count ? size : next_line_start(fd, start + (off_t)((size - start) * i / count), size);
+        if (end > begin) {
+            Shard shard;
+            shard.begin = begin;
+            shard.end = end;
+            shards.push_back(std::move(shard));
+        }
+        begin = end > begin ? end : begin;
+    }
+
+    return shards;
+}
+
+#ifdef __linux__
+// the CPUs of each NUMA node, read from sysfs rather than through libnuma
+struct NumaTopology {
+
+    std::vector<int> node_ids;
+    std::vector<std::vector<int>> nodes;
+
+    void discover() {
+        DIR* dir = opendir("/sys/devices/system/node");
+        if (!dir) return;
+
+        std::vector<int> ids;
+        while (dirent* entry = readdir(dir)) {
+            int id;
+            if (sscanf(entry->d_name, "node%d", &id) == 1) ids.push_back(id);
+        }
+        closedir(dir);
+
+        std::sort(ids.begin(), ids.end());
+
+        for (int id : ids) {
+            char path[64];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+
+            FILE* file = fopen(path, "r");
+            if (!file) continue;
+
+            char list[4096];
+            bool read = fgets(list, sizeof(list), file) != nullptr;
+            fclose(file);
+            if (!read) continue;
+
+            // "0-3,8-11"
+            std::vector<int> cpus;
+            char const* cursor = list;
+            while (*cursor) {
+                char* end;
+                long first = strtol(cursor, &end, 10);
+                if (end == cursor) break;
+
+                long last = first;
+                if (*end == '-') {
+                    cursor = end + 1;
+                    last = strtol(cursor, &end, 10);
+                }
+
+                for (long cpu = first; cpu <= last; cpu++) cpus.push_back((int)cpu);
+
+                cursor = *end == ',' ? end + 1 : end;
+            }
+
+            if (!cpus.empty()) {
+                node_ids.push_back(id);
+                nodes.push_back(std::move(cpus));
+            }
+        }
+    }
+
+    // pins the calling process to the CPUs of node `index` and makes the kernel
+    // prefer that node's memory for everything it allocates from now on
+    void bind(size_t index) const {
+        // sized for the highest CPU id, which may be past CPU_SETSIZE
+        int highest = *std::max_element(nodes[index].begin(), nodes[index].end());
+        cpu_set_t* set = CPU_ALLOC(highest + 1);
+        if (set) {
+            size_t size = CPU_ALLOC_SIZE(highest + 1);
+            CPU_ZERO_S(size, set);
+            for (int cpu : nodes[index]) {
+                if (cpu >= 0) CPU_SET_S(cpu, size, set);
+            }
+            sched_setaffinity(0, size, set);
+            CPU_FREE(set);
+        }
+
+        static constexpr int mpol_preferred = 1;
+        unsigned long mask[16] = {0};
+        int id = node_ids[index];
+        if (id < (int)(sizeof(mask) * 8)) {
+            mask[id / (sizeof(unsigned long) * 8)] |= 1ul << (id % (sizeof(unsigned long) * 8));
+            syscall(SYS_set_mempolicy, mpol_preferred, mask, sizeof(mask) * 8);
+        }
+    }
+};
+#else
+// NUMA placement is only implemented for Linux
+struct NumaTopology {
+    std::vector<std::vector<int>> nodes;
+
+    void discover() {}
+    void bind(size_t) const {}
+};
+#endif
+
+// runs in a forked worker: evaluates one shard and writes its results to `out`
+[[noreturn]] static void
+run_shard(int input, Shard const& shard, int out, BatchJob job) {
+    size_t size = (size_t)(shard.end - shard.begin);
+
+    LargeBuffer bytes;
+    if (!bytes.allocate(size, job.huge_pages) || !bytes.read(input, shard.begin, size)) _exit(1);
+
+    LineReader in(bytes.data, size, shard.begin);
+    LineWriter writer(out);
+
+    // only the coordinator knows which shards have been written out
+    job.checkpoint = nullptr;
+
+    bool ok = run_batch(in, writer, job);
+    _exit(writer.flush() && ok ? 0 : 1);
+}
+
+// splits the input into shards on line boundaries and evaluates them in up to
+// `workers` child processes, each sending its results back over a socket.
+// A shard whose worker fails is retried in a new process; the results are
+// written to `out` in input order as soon as every earlier shard is done,
+// and `checkpoint` (if any) is saved after each shard that is written. With
+// `numa`, shards are dealt round-robin to the NUMA nodes and each worker is
+// bound to its node before it reads its shard, so the shard's buffers and
+// everything allocated while evaluating it are node-local.
+static bool
+run_sharded_batch(char const* path, LineWriter& out, size_t workers, BatchJob const& job, NumaTopology const* numa) {
+    static constexpr int max_attempts = 3;
+
+    struct Worker {
+        pid_t pid;
+        int fd;
+        size_t shard;
+        std::string output;
+    };
+
+    int input = open(path, O_RDONLY);
+    if (input < 0) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(input, &st) != 0) {
+        close(input);
+        return false;
+    }
+
+    Checkpoint* checkpoint = job.checkpoint;
+    off_t start = checkpoint ? (off_t)checkpoint->input_offset : 0;
+    std::vector<Shard> shards = split_into_shards(input, start, st.st_size, workers * 4);
+    std::deque<size_t> queue;
+    for (size_t i = 0; i < shards.size(); i++) {
+        queue.push_back(i);
+    }
+
+    std::vector<Worker> running;
+    size_t written = 0;
+    bool ok = true;
+
+    fflush(nullptr);
+
+    while (ok && written < shards.size()) {
+        while (running.size() < workers && !queue.empty()) {
+            size_t index = queue.front();
+            queue.pop_front();
+            shards[index].attempts++;
+
+            int sockets[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+                ok = false;
+                break;
+            }
+
+            pid_t pid = fork();
+            if (pid < 0) {
+                close(sockets[0]);
+                close(sockets[1]);
+                ok = false;
+                break;
+            }
+
+            if (pid == 0) {
+                close(sockets[0]);
+                for (auto const& worker : running) {
+                    close(worker.fd);
+                }
+                if (numa && !numa->nodes.empty()) {
+                    numa->bind(index % numa->nodes.size());
+                }
+                run_shard(input, shards[index], sockets[1], job);
+            }
+
+            close(sockets[1]);
+            running.push_back(Worker{ pid, sockets[0], index, {} });
+        }
+
+        if (!ok || running.empty()) break;
+
+        std::vector<pollfd> fds;
+        for (auto const& worker : running) {
+            fds.push_back(pollfd{ worker.fd, POLLIN, 0 });
+        }
+
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            ok = false;
+            break;
+        }
+
+        for (size_t i = running.size(); i-- > 0;) {
+            if (!fds[i].revents) continue;
+
+            Worker& worker = running[i];
+            char buffer[1 << 16];
+            ssize_t n = read(worker.fd, buffer, sizeof(buffer));
+
+            if (n > 0) {
+                worker.output.append(buffer, (size_t)n);
+                continue;
+            }
+
+            if (n < 0 && errno == EINTR) continue;
+
+            close(worker.fd);
+
+            int status = 0;
+            waitpid(worker.pid, &status, 0);
+
+            Shard& shard = shards[worker.shard];
+
+            if (n == 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+                shard.output = std::move(worker.output);
+                shard.done = true;
+            } else if (shard.attempts < max_attempts) {
+                queue.push_back(worker.shard);
+            } else {
+                fprintf(stderr, "shard at bytes %lld-%lld failed %d times\n",
+                    (long long)shard.begin, (long long)shard.end, shard.attempts);
+                ok = false;
+            }
+
+            running.erase(running.begin() + i);
+        }
+
+        while (written < shards.size() && shards[written].done) {
+            out.write(shards[written].output);
+            std::string().swap(shards[written].output);
+
+            if (checkpoint && !checkpoint->save(out, (long long)shards[written].end)) {
+                ok = false;
+                break;
+            }
+
+            written++;
+        }
+    }
+
+    for (auto const& worker : running) {
+        kill(worker.pid, SIGKILL);
+        close(worker.fd);
+        waitpid(worker.pid, nullptr, 0);
+    }
+
+    close(input);
+    return ok;
+}
+#endif
+
+// stores what a benchmark computed where the optimizer has to assume it is
+// read, so the work that produced it can't be removed
+static volatile double benchmark_sink;
+
+static void
+keep(double value) {
+    benchmark_sink = value;
+}
+
+// seconds per call of `body`, over enough calls to take about `seconds`
+template <typename Body>
+static double
+time_per_call(double seconds, Body&& body) {
+    size_t calls = 0;
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed;
+    do {
+        body();
+        calls++;
+        elapsed = std::chrono::steady_clock::now() - start;
+    } while (elapsed.count() < seconds);
+
+    return elapsed.count() / (double)calls;
+}
+
+// the formulas the graph benchmarks work on: `sheets` sheets of `cells`,
+// each sheet's first cell an input and every other cell combining two
+// earlier cells of the same sheet. Cell i is named `names[i]`.
+static void
+define_sheets(FormulaGraph& formulas, size_t sheets, size_t cells, std::vector<std::string>& names) {
+    std::mt19937_64 random(1);
+
+    names.resize(sheets * cells);
+    for (size_t i = 0; i < names.size(); i++) names[i] = "c" + std::to_string(i);
+
+    std::string source;
+    for (size_t i = 0; i < names.size(); i++) {
+        size_t cell = i % cells;
+        source = cell == 0
+            ? std::to_string(i)
+            : names[i - 1 - random() % cell] + " * 3 + " + names[i - 1 - random() % cell] + " / 2";
+        formulas.define(names[i], Lexer(source));
+    }
+}
+
+// a graph of 10^5 formulas in 1000 sheets of 100: how long defining it
+// takes, then how long changing an input and reading the last formula of its
+// sheet takes, which recomputes only the dirty formulas that one needs
+static void
+benchmark_formula_graph(Limits const& limits) {
+    static constexpr size_t sheets = 1000;
+    static constexpr size_t cells = 100;
+    static constexpr size_t size = sheets * cells;
+
+    std::mt19937_64 random(1);
+    FormulaGraph formulas;
+    formulas.limits = limits;
+    std::vector<std::string> names;
+
+    auto start = std::chrono::steady_clock::now();
+    define_sheets(formulas, sheets, cells, names);
+    double define = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    double sink = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t sheet = 0; sheet < sheets; sheet++) sink += formulas.value(formulas.slot(names[sheet * cells + cells - 1]));
+    double first = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<std::string> values(64);
+    for (size_t i = 0; i < values.size(); i++) values[i] = std::to_string(i * 7);
+
+    size_t updates = 0;
+    auto update = [&]() {
+        size_t sheet = random() % sheets;
+        formulas.define(names[sheet * cells], Lexer(values[updates++ % values.size()]));
+        return sheet;
+    };
 
-enum class Associativity {
-    LEFT,
-    RIGHT
-};
+    // how many formulas a read after an update recomputes, counted outside
+    // the timing
+    auto dirty = [&formulas]() {
+        return (size_t)std::count_if(formulas.nodes.begin(), formulas.nodes.end(), [](auto const& node) { return node.dirty; });
+    };
 
-struct OperatorPrecedence {
-    int prec;
-    Associativity assoc;
-};
+    size_t recomputed = 0;
+    static constexpr size_t counted = 100;
+    for (size_t i = 0; i < counted; i++) {
+        size_t sheet = update();
+        size_t before = dirty();
+        sink += formulas.value(formulas.slot(names[sheet * cells + cells - 1]));
+        recomputed += before - dirty();
+    }
 
-enum TokenType {
-    ADD = 0,
-    SUBTRACT = 1,
-    MULTIPLY = 2,
-    DIVIDE = 3,
-    POWER = 4,
-    NUMBER,
-    LEFT_PAREN,
-    RIGHT_PAREN,
-    ILLEGAL_CHARACTER,
-    END_OF_FILE,
-};
+    double seconds = time_per_call(0.5, [&]() {
+        size_t sheet = update();
+        sink += formulas.value(formulas.slot(names[sheet * cells + cells - 1]));
+    });
 
-OperatorPrecedence OperatorMap[] = {
-    OperatorPrecedence { 1, Associativity::LEFT }, // TokenType::ADD
-    OperatorPrecedence { 1, Associativity::LEFT }, // TokenType::SUBTRACT
-    OperatorPrecedence { 2, Associativity::LEFT }, // TokenType::MULTIPLY
-    OperatorPrecedence { 2, Associativity::LEFT }, // TokenType::DIVIDE
-    OperatorPrecedence { 3, Associativity::RIGHT }, // TokenType::POWER
-};
+    keep(sink);
+    printf("graph  %zu formulas: define %.0f ms, evaluate all %.1f ms, update and read %.2f us (%.0f formulas recomputed)\n",
+        size, define * 1e3, first * 1e3, seconds * 1e6, (double)recomputed / counted);
+}
 
-struct Token {
-    std::string_view string;
-    TokenType type;
-};
+// 10^4 what-if scenarios alive at once over a graph of 10^5 formulas, each
+// overriding one input and reading the last formula of that input's sheet:
+// how long creating and reading one takes, reading it again, and the memory
+// each needs, estimated from the size of its table of entries
+static void
+benchmark_scenarios(Limits const& limits) {
+    static constexpr size_t sheets = 1000;
+    static constexpr size_t cells = 100;
+    static constexpr size_t count = 10000;
+
+    FormulaGraph formulas;
+    formulas.limits = limits;
+    std::vector<std::string> names;
+    define_sheets(formulas, sheets, cells, names);
+
+    std::mt19937_64 random(2);
+    std::vector<uint32_t> outputs(count);
+    std::vector<Scenario> scenarios;
+    scenarios.reserve(count);
+    double sink = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++) {
+        size_t sheet = random() % sheets;
+        outputs[i] = formulas.slot(names[sheet * cells + cells - 1]);
+
+        scenarios.emplace_back(formulas);
+        scenarios.back().set(formulas.slot(names[sheet * cells]), (double)i);
+        sink += scenarios.back().value(outputs[i]);
+    }
+    double create = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++) sink += scenarios[i].value(outputs[i]);
+    double reread = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    size_t entries = 0;
+    size_t bytes = 0;
+    for (auto const& scenario : scenarios) {
+        entries += scenario.entries.size();
+        // a node per entry holding the pair and a next pointer, and a bucket
+        // pointer per bucket
+        bytes += sizeof(Scenario) + scenario.entries.size() * (sizeof(std::pair<uint32_t const, Scenario::Entry>) + sizeof(void*))
+            + scenario.entries.bucket_count() * sizeof(void*);
+    }
+
+    keep(sink);
+    printf("scenarios %zu over %zu formulas: create, set and read %.2f us, read again %.3f us, "
+        "%.0f entries and about %.0f bytes each\n",
+        count, sheets * cells, create / count * 1e6, reread / count * 1e6,
+        (double)entries / count, (double)bytes / count);
+}
 
+// formulas over a, b, c and d evaluated with a and b bound, before and
+// after specializing them on those bindings
 static void
-print_token(Token t) {
-    std::string token_type =
-        t.type == TokenType::ADD ? "ADD" :
-        t.type == TokenType::MULTIPLY ? "MULTIPLY" :
-        t.type == TokenType::NUMBER ? "NUMBER" :
-        t.type == TokenType::END_OF_FILE ? "END_OF_FILE" :
-        "ILLEGAL";
+benchmark_specialization(Limits const& limits) {
+    static char const* const formulas[] = {
+        "(a * 2 + b) * (c - d / 4) + a ** 2 - b * 3",
+        "a * c + b * d + (a + b) * (c + d) / (a * b + 1)",
+        "(c - a) ** 2 / (b ** 2 + 1) + (d - a * b) / (a + b)",
+        "a ** b - c * (a - b) + d / (a * 10 + b * 100)",
+    };
+
+    for (char const* source : formulas) {
+        SymbolTable symbols;
+        Program program = compile(Engine::CLIMBING, Lexer(source), symbols, limits);
+
+        uint32_t a = symbols.intern("a");
+        uint32_t b = symbols.intern("b");
+        uint32_t c = symbols.intern("c");
+        uint32_t d = symbols.intern("d");
 
-    printf("{ '%.*s', %s }\n", (int)t.string.length(), t.string.data(), token_type.c_str());
+        std::vector<double> values(symbols.names.size());
+        values[a] = 3;
+        values[b] = 7;
+
+        std::unordered_map<uint32_t, double> bindings{ { a, values[a] }, { b, values[b] } };
+        Program general = optimize(program);
+        Program specialized = specialize(program, bindings);
+
+        auto variable = [&values](uint32_t slot) {
+            return values[slot];
+        };
+
+        double sink = 0;
+        auto time = [&](Program const& candidate) {
+            return time_per_call(0.25, [&]() {
+                for (int i = 0; i < 1000; i++) {
+                    values[c] = i;
+                    values[d] = i * 0.5;
+                    sink += evaluate(candidate, variable);
+                }
+            }) / 1000;
+        };
+
+        double before = time(general);
+        double after = time(specialized);
+        keep(sink);
+
+        printf("specialize %-52s %2zu -> %2zu instructions, %6.1f -> %6.1f ns, %.2fx\n", source,
+            general.code.size(), specialized.code.size(), before * 1e9, after * 1e9, before / after);
+    }
 }
 
-struct Lexer {
-    std::string source;
+// a formula with lags and rolling windows stepped over many series at once:
+// how many series the evaluator advances by one time step per second
+static void
+benchmark_series(Limits const& limits) {
+    static constexpr size_t steps = 1000;
+
+    SymbolTable symbols;
+    Program program = compile(Engine::CLIMBING, Lexer("(x - mean(x, 20)) / (sum(y, 5) + 1) + x[t-1] - y[t-3]"), symbols, limits);
+
+    std::mt19937_64 random(3);
+
+    for (size_t series : { 1, 64, 1024 }) {
+        SeriesEvaluator evaluator(optimize(program), series);
+
+        std::vector<std::vector<double>> inputs(evaluator.inputs.size(), std::vector<double>(series * 16));
+        for (auto& input : inputs) {
+            for (auto& value : input) value = (double)(random() % 1000);
+        }
 
-    size_t current_position;
-    size_t end;
+        std::vector<double const*> columns(inputs.size());
+        std::vector<double> out(series);
+        double sink = 0;
 
-    Lexer(std::string source) {
-        this->source = source;
-        this->current_position = 0;
-        this->end = source.length();
+        double seconds = time_per_call(0.25, [&]() {
+            for (size_t step = 0; step < steps; step++) {
+                for (size_t i = 0; i < inputs.size(); i++) columns[i] = inputs[i].data() + step % 16 * series;
+                evaluator.step(columns.data(), out.data());
+                sink += out[0];
+            }
+        });
+
+        keep(sink);
+        printf("series %5zu at once: %8.2f M series steps/s\n", series, (double)(series * steps) / seconds / 1e6);
     }
+}
 
-    Token
-    make_simple_token(TokenType type) {
-        return Token{
-            std::string_view(&source[current_position], 1),
-            type
-        };
+// the shared result cache against evaluating: a hit, a miss, and parsing the
+// same line instead. The table is mapped from a temporary file, as `--cache`
+// maps its own.
+static void
+benchmark_shared_cache(Limits const& limits) {
+#ifndef _WIN32
+    static constexpr size_t count = 10000;
+
+    char path[] = "/tmp/calculator-cacheXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) return;
+    close(fd);
+
+    SharedResultCache cache;
+    bool opened = cache.open(path);
+    unlink(path);
+    if (!opened) return;
+
+    std::vector<std::string> lines(count * 2);
+    for (size_t i = 0; i < lines.size(); i++) {
+        lines[i] = std::to_string(i) + " * 3 + (" + std::to_string(i % 97) + " - 7) / 2 ** 2";
     }
 
-    bool is_at_end() {
-        return current_position >= end;
+    for (size_t i = 0; i < count; i++) {
+        Parser parser{ Lexer(lines[i]) };
+        cache.insert(0, lines[i], parser.parse());
     }
 
-    char peek() {
-        return is_at_end() ? '\0' : source[current_position];
+    size_t next = 0;
+    double value, sink = 0;
+
+    double hit = time_per_call(0.25, [&]() {
+        sink += cache.find(0, lines[next++ % count], value) ? value : 0;
+    });
+    double miss = time_per_call(0.25, [&]() {
+        sink += cache.find(0, lines[count + next++ % count], value) ? value : 0;
+    });
+    double parse = time_per_call(0.25, [&]() {
+        Parser parser{ Lexer(lines[next++ % count]) };
+        parser.limits = limits;
+        sink += parser.parse();
+    });
+
+    keep(sink);
+    printf("shared cache: hit %.0f ns, miss %.0f ns, parse and evaluate instead %.0f ns\n",
+        hit * 1e9, miss * 1e9, parse * 1e9);
+#else
+    (void)limits;
+#endif
+}
+
+// reading through memory from a process left wherever the scheduler puts it,
+// and from one bound to each NUMA node the way `--numa` binds batch workers.
+// Each measurement runs in a forked child, so no binding outlives it.
+static void
+benchmark_numa() {
+#ifdef __linux__
+    static constexpr size_t size = 64 << 20;
+
+    NumaTopology numa;
+    numa.discover();
+
+    auto measure = [&numa](size_t const* node) -> double {
+        int fds[2];
+        if (pipe(fds) != 0) return NAN;
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            if (node) numa.bind(*node);
+
+            double seconds = NAN;
+            LargeBuffer buffer;
+            if (buffer.allocate(size, false)) {
+                memset(buffer.data, 1, size);
+                seconds = time_per_call(0.25, [&]() {
+                    size_t sum = 0;
+                    for (size_t i = 0; i < size; i += 64) sum += (unsigned char)buffer.data[i];
+                    keep((double)sum);
+                });
+            }
+
+            _exit(write(fds[1], &seconds, sizeof(seconds)) == sizeof(seconds) ? 0 : 1);
+        }
+
+        close(fds[1]);
+        double seconds = NAN;
+        if (pid < 0 || read(fds[0], &seconds, sizeof(seconds)) != sizeof(seconds)) seconds = NAN;
+        close(fds[0]);
+        if (pid > 0) waitpid(pid, nullptr, 0);
+        return seconds;
+    };
+
+    printf("numa   unbound %.2f GB/s", (double)size / measure(nullptr) / 1e9);
+    for (size_t node = 0; node < numa.nodes.size(); node++) {
+        printf(", bound to node %d %.2f GB/s", numa.node_ids[node], (double)size / measure(&node) / 1e9);
     }
+    printf("\n");
+#endif
+}
+
+// random reads from a LargeBuffer with and without huge pages. With 4 KB
+// pages nearly every read of a 256 MB buffer misses the TLB; with 2 MB pages
+// the whole buffer needs only 128 entries.
+static void
+benchmark_huge_pages() {
+#ifndef _WIN32
+    static constexpr size_t size = 256 << 20;
+    static constexpr size_t reads = 1 << 20;
+
+    printf("pages  random reads from %zu MB:", size >> 20);
+
+    for (bool huge_pages : { false, true }) {
+        LargeBuffer buffer;
+        if (!buffer.allocate(size, huge_pages)) continue;
+        memset(buffer.data, 1, size);
+
+        // each read's address depends on the one before, so misses don't overlap
+        double seconds = time_per_call(0.25, [&]() {
+            size_t position = 0;
+            for (size_t i = 0; i < reads; i++) {
+                position = (position * 6364136223846793005ull + 1442695040888963407ull + (unsigned char)buffer.data[position]) % size;
+            }
+            keep((double)position);
+        });
 
-    char peek_next() {
-        return is_at_end() ? '\0' : source[current_position + 1];
+        printf("%s %.1f ns", huge_pages ? ", huge pages" : " 4 KB pages", seconds / reads * 1e9);
     }
 
-    char read_next() {
-        return is_at_end() ? '\0' : source[current_position++];
+    printf("\n");
+#endif
+}
+
+// what holding evaluation to limits.max_instructions costs: a long program run
+// straight through, and the same program run in slices the way a worker
+// resumes an Execution it had to put aside
+static void
+benchmark_limits(std::string const& source, Limits const& limits) {
+    SymbolTable symbols;
+    Program program = compile(Engine::CLIMBING, Lexer(source), symbols, limits);
+    auto zero = [](uint32_t) { return 0.0; };
+    double sink = 0;
+
+    double whole = time_per_call(0.25, [&]() { sink += evaluate(program, zero); });
+
+    printf("limits wide: evaluate %.1f us whole", whole * 1e6);
+    for (size_t slice : { 10000, 1000, 100 }) {
+        double sliced = time_per_call(0.25, [&]() {
+            Execution execution(program);
+            while (!execution.run(zero, slice)) {
+            }
+            sink += execution.result();
+        });
+        printf(", %.1f us in slices of %zu", sliced * 1e6, slice);
     }
+    printf("\n");
+
+    keep(sink);
+}
 
-    void skip_whitespace() {
-        for (;;) {
-            char c = peek();
+// how long an error in an 8 MB source takes to report, message and snippet
+// included, when it is near the start and when it is at the end, with the
+// source as one line and as a line per term
+static void
+benchmark_error_reporting(Limits const& limits) {
+    static constexpr size_t terms = 1 << 21;
+
+    for (char const* separator : { " + ", " +\n" }) {
+        std::string body;
+        body.reserve(terms * 4);
+        for (size_t i = 0; i < terms; i++) {
+            body += '1';
+            body += separator;
+        }
 
-            switch (c) {
-                case '\n':
-                case '\t':
-                case '\r':
-                case ' ': {
-                    read_next();
-                    continue;
+        std::string start = "$" + body + "1";
+        std::string end = body + "1 $";
+
+        for (std::string const* source : { &start, &end }) {
+            double seconds = time_per_call(0.25, [&]() {
+                try {
+                    Parser parser{ Lexer(*source) };
+                    parser.limits = limits;
+                    keep(parser.parse());
+                } catch (Parser::ParserException& e) {
+                    keep((double)strlen(e.what()));
                 }
-            }
+            });
 
-            break;
+            printf("error report, %-9s error at the %-5s %8.2f ms\n", separator[2] == '\n' ? "lines," : "one line,",
+                source == &start ? "start" : "end", seconds * 1e3);
         }
     }
+}
 
-    Token 
-    number() {
+// validating a catalog of lines with four errors each: finding the first
+// error by catching the exception, against collecting all four in one pass
+// with Parser::check, as --check does
+static void
+benchmark_recovery(Limits const& limits) {
+    static char const* const catalog[] = {
+        "1 + $ * (2 + ) - 3 @ 4 + (5",
+        "(1 * ) + 2 # 3 - (4 + ! * 5",
+        "7 + ? * (8 ** ) & 9 - (1",
+    };
 
-        size_t start = current_position;
-        read_next();
+    size_t next = 0;
+    size_t errors = 0;
 
-        for (;;) {
-            char c = peek();
-            if (!isdigit(c)) break;
-            else read_next();
+    double first = time_per_call(0.25, [&]() {
+        try {
+            Parser parser{ Lexer(catalog[next++ % 3]) };
+            parser.limits = limits;
+            keep(parser.parse());
+        } catch (Parser::ParserException& e) {
+            keep((double)strlen(e.what()));
         }
+    });
+
+    double all = time_per_call(0.25, [&]() {
+        Parser parser{ Lexer(catalog[next++ % 3]) };
+        parser.limits = limits;
+        errors = parser.check().size();
+    });
+
+    printf("error recovery: first error by throwing %.0f ns, all %zu errors in one pass %.0f ns\n",
+        first * 1e9, errors, all * 1e9);
+}
 
-        return Token{ std::string_view(&source[start], ((long long)current_position - start)), TokenType::NUMBER };
+// writing result lines to the null device through LineWriter, as the REPL and
+// batch modes do, against writing them through stdio
+static void
+benchmark_line_output() {
+    static constexpr size_t count = 1 << 16;
+
+    std::vector<std::string> lines(count);
+    for (size_t i = 0; i < count; i++) {
+        char buffer[64];
+        snprintf(buffer, sizeof(buffer), " = %.17g\n", (double)i / 7);
+        lines[i] = buffer;
     }
 
-    Token next_token() {
-        skip_whitespace();
+#ifdef _WIN32
+    int null = _open("NUL", _O_WRONLY);
+    FILE* file = fopen("NUL", "w");
+#else
+    int null = open("/dev/null", O_WRONLY);
+    FILE* file = fopen("/dev/null", "w");
+#endif
+    if (null < 0 || !file) return;
+
+    // a batch of lines per call, so reading the clock doesn't dominate
+    static constexpr size_t batch = 64;
+    LineWriter writer(null);
+    size_t next = 0;
+
+    double line_writer = time_per_call(0.25, [&]() {
+        for (size_t i = 0; i < batch; i++) writer.write(lines[next++ % count]);
+    });
+    writer.flush();
+
+    double stdio = time_per_call(0.25, [&]() {
+        for (size_t i = 0; i < batch; i++) fputs(lines[next++ % count].c_str(), file);
+    });
+
+    fclose(file);
+    close_file(null);
+    printf("line output: LineWriter %.1f ns, stdio %.1f ns per line\n", line_writer / batch * 1e9, stdio / batch * 1e9);
+}
+
+// whole REPL lines run with each engine, and the heap allocations each one
+// makes once the buffers it reuses have grown
+static void
+benchmark_repl_lines(Limits const& limits) {
+    static char const* const infix[] = { "x * 2 + y / 3", "(x - y) ** 2 / (x + 1)", "1 + 2 * 3 - 4 / 5" };
+    static char const* const rpn[] = { "x 2 * y 3 / +", "x y - 2 ** x 1 + /", "1 2 3 * + 4 5 / -" };
+
+    FormulaGraph formulas;
+    formulas.limits = limits;
+    formulas.define("x", Lexer("3"));
+    formulas.define("y", Lexer("x * 2"));
+
+#ifdef _WIN32
+    int null = _open("NUL", _O_WRONLY);
+#else
+    int null = open("/dev/null", O_WRONLY);
+#endif
+
+    std::pair<char const*, Engine> engines[] = {
+        { "climbing", Engine::CLIMBING },
+        { "shunting-yard", Engine::SHUNTING_YARD },
+        { "pratt", Engine::PRATT },
+        { "rpn", Engine::RPN },
+    };
+
+    for (auto const& [name, engine] : engines) {
+        std::vector<std::string> lines;
+        for (size_t i = 0; i < 3; i++) lines.emplace_back(engine == Engine::RPN ? rpn[i] : infix[i]);
+
+        formulas.engine = engine;
+        Console console(null);
+        size_t next = 0;
+        size_t calls = 0;
+
+        for (auto const& line : lines) run_line(formulas, console, line);
+        size_t before = allocation_count;
+        double seconds = time_per_call(0.25, [&]() {
+            run_line(formulas, console, lines[next++ % lines.size()]);
+            calls++;
+        });
+        size_t allocations = allocation_count - before;
+
+        printf("REPL line %-14s %6.0f ns, %.3f allocations per line\n", name, seconds * 1e9,
+            (double)allocations / (double)calls);
+    }
 
-        char c = peek();
+    close_file(null);
+}
 
-        Token t;
+// compiles generated corpora with every engine and prints their throughput:
+// deeply nested parentheses, long flat chains of mixed operators, and long
+// chains of the right-associative `**`, nested just inside the default depth
+// limit. The rpn engine reads each corpus converted to reverse Polish notation.
+static void
+run_benchmark(Limits const& limits) {
+    static constexpr size_t corpus_bytes = 1 << 20;
+    static constexpr size_t rounds = 32;
+
+    std::string deep;
+    for (int i = 0; i < 900; i++) deep += '(';
+    deep += '1';
+    for (int i = 0; i < 900; i++) deep += "+2)";
+
+    std::string wide = "1";
+    for (int i = 0; wide.length() < corpus_bytes; i++) {
+        wide += "+-*/"[i % 4];
+        wide += std::to_string(i % 97 + 1);
+    }
 
-        if (isdigit(c)) {
-            t = number();
-        } else {
-            switch (c) {
-                case '+' : { t = make_simple_token(TokenType::ADD); read_next(); } break;
-                case '-' : { t = make_simple_token(TokenType::SUBTRACT); read_next(); } break;
-                case '*' : {
-                    if (peek_next() == '*') {
-                        t = Token{
-                            std::string_view(&source[current_position], 2),
-                            TokenType::POWER
-                        };
-                        read_next();
-                    } else {
-                        t = make_simple_token(TokenType::MULTIPLY); 
-                    }
-                    read_next();
-                } break;
-                case '/' : { t = make_simple_token(TokenType::DIVIDE); read_next(); } break;
-                case '(' : { t = make_simple_token(TokenType::LEFT_PAREN); read_next(); } break;
-                case ')' : { t = make_simple_token(TokenType::RIGHT_PAREN); read_next(); } break;
+    std::string right = "1";
+    for (int i = 0; i < 900; i++) right += "**1";
 
-                default: {
-                    t = 
-                        c == '\0' ?
-                            make_simple_token(TokenType::END_OF_FILE) :
-                            make_simple_token(TokenType::ILLEGAL_CHARACTER);
-                    read_next();
-                } break;
+    struct Corpus {
+        char const* name;
+        std::string const& source;
+    };
+
+    Corpus corpora[] = { { "deep", deep }, { "wide", wide }, { "right", right } };
+    std::pair<char const*, Engine> engines[] = {
+        { "climbing", Engine::CLIMBING },
+        { "shunting-yard", Engine::SHUNTING_YARD },
+        { "pratt", Engine::PRATT },
+        { "rpn", Engine::RPN },
+    };
+
+    for (auto const& corpus : corpora) {
+        SymbolTable symbols;
+        Program reference = compile(Engine::CLIMBING, Lexer(corpus.source), symbols, limits);
+        std::string rpn = to_rpn(reference, symbols);
+
+        // every round compiles about `corpus_bytes`, however long the corpus
+        size_t repeat = std::max<size_t>(1, corpus_bytes / corpus.source.length());
+
+        for (auto const& [name, engine] : engines) {
+            std::string const& source = engine == Engine::RPN ? rpn : corpus.source;
+            size_t instructions = 0;
+            bool same = true;
+
+            auto start = std::chrono::steady_clock::now();
+            for (size_t round = 0; round < rounds * repeat; round++) {
+                Program program = compile(engine, Lexer(source), symbols, limits);
+                instructions += program.code.size();
+                same = same && program.code.size() == reference.code.size()
+                    && std::equal(program.code.begin(), program.code.end(), reference.code.begin(),
+                        [](Instruction a, Instruction b) { return a.op == b.op && a.operand == b.operand; });
             }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            printf("%-6s %-14s %8.1f MB/s %8.1f M instructions/s%s\n", corpus.name, name,
+                (double)(source.length() * rounds * repeat) / seconds / 1e6,
+                (double)instructions / seconds / 1e6,
+                same ? "" : "  (program differs from climbing)");
         }
+    }
+
+    // sending the compiled program instead of the text: its size, the cost of
+    // encoding it, and of getting a value out of it again on the other side
+    for (auto const& corpus : corpora) {
+        SymbolTable symbols;
+        Program program = compile(Engine::CLIMBING, Lexer(corpus.source), symbols, limits);
+        std::string encoded = encode_program(program, symbols);
+        size_t repeat = std::max<size_t>(1, corpus_bytes / corpus.source.length()) * rounds;
+
+        auto time = [&](auto&& body) {
+            auto start = std::chrono::steady_clock::now();
+            for (size_t round = 0; round < repeat; round++) body();
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / (double)repeat * 1e6;
+        };
 
-        return t;
+        double sink = 0;
+        double encode = time([&]() { sink += (double)encode_program(program, symbols).size(); });
+        double parse = time([&]() { sink += Parser{ Lexer(corpus.source) }.parse(); });
+        double open = time([&]() {
+            EncodedProgram reader;
+            reader.open(encoded.data(), encoded.size());
+            sink += (double)reader.instructions;
+        });
+        double decode = time([&]() {
+            EncodedProgram reader;
+            reader.open(encoded.data(), encoded.size());
+            sink += (double)reader.decode(symbols).code.size();
+        });
+        double evaluate = time([&]() {
+            EncodedProgram reader;
+            reader.open(encoded.data(), encoded.size());
+            sink += reader.evaluate([](uint32_t) { return 0.0; });
+        });
+
+        printf("%-6s text %8zu bytes, encoded %8zu bytes; us per expression: encode %.1f, "
+            "parse text %.1f, open %.1f, open+decode %.1f, open+evaluate %.1f\n",
+            corpus.name, corpus.source.length(), encoded.size(), encode, parse, open, decode, evaluate);
+        keep(sink);
+    }
+
+    // the columnar evaluator at every CPU level this machine supports
+    SymbolTable symbols;
+    Program program = compile(Engine::CLIMBING, Lexer("x * 2 + y / 3 - x * y + (x - y) / (x + 1)"), symbols, limits);
+    static constexpr size_t rows = 4096;
+    std::vector<double> columns[2] = { std::vector<double>(rows), std::vector<double>(rows) };
+    for (size_t row = 0; row < rows; row++) {
+        columns[0][row] = (double)row;
+        columns[1][row] = (double)(rows - row);
     }
-};
 
-struct Parser {
+    std::vector<double> stack;
+    std::vector<double> out(rows);
+    CpuLevel active = cpu_level();
+
+    for (int level = 0; level <= (int)supported_cpu_level(); level++) {
+        cpu_level() = (CpuLevel)level;
+
+        size_t calls = 0;
+        auto start = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed;
+        do {
+            for (int i = 0; i < 64; i++, calls++) {
+                evaluate_columns(program, rows, [&](Instruction instruction) {
+                    return columns[instruction.operand].data();
+                }, stack, out.data());
+            }
+            elapsed = std::chrono::steady_clock::now() - start;
+        } while (elapsed.count() < 0.5);
 
-    Lexer lexer;
-    Token token;
+        printf("columns %-8s %6.2f ns per row%s\n", cpu_level_names[level],
+            elapsed.count() / (double)(calls * rows) * 1e9, (CpuLevel)level == active ? "  (in use)" : "");
+    }
 
-    Parser(Lexer l) : lexer(l) {}
+    cpu_level() = active;
+
+    benchmark_repl_lines(limits);
+    benchmark_error_reporting(limits);
+    benchmark_recovery(limits);
+    benchmark_line_output();
+    benchmark_formula_graph(limits);
+    benchmark_scenarios(limits);
+    benchmark_specialization(limits);
+    benchmark_series(limits);
+    benchmark_limits(wide, limits);
+    benchmark_shared_cache(limits);
+    benchmark_numa();
+    benchmark_huge_pages();
+}
 
-    void next_token() {
-        token = lexer.next_token();
+// appends a random expression over the variables x, y and z to `out`
+static void
+random_expression(std::mt19937_64& random, int depth, std::string& out) {
+    if (depth == 0 || random() % 4 == 0) {
+        if (random() % 3 == 0) {
+            out += "xyz"[random() % 3];
+        } else {
+            out += std::to_string(random() % 100);
+        }
+        return;
     }
 
-    double parse() {
-        return compute_expr(1);
+    static char const* const operators[] = { " + ", " - ", " * ", " / ", " ** " };
+
+    bool group = random() % 3 == 0;
+    if (group) out += '(';
+
+    random_expression(random, depth - 1, out);
+    out += operators[random() % 5];
+    random_expression(random, depth - 1, out);
+
+    if (group) out += ')';
+}
+
+// number of representable doubles between a and b, with -0 and +0 one
+// apart; 0 only if they are the same bits or both NaN
+static uint64_t
+ulp_distance(double a, double b) {
+    if (std::isnan(a) || std::isnan(b)) return std::isnan(a) && std::isnan(b) ? 0 : UINT64_MAX;
+
+    int64_t ia, ib;
+    memcpy(&ia, &a, sizeof(a));
+    memcpy(&ib, &b, sizeof(b));
+
+    // map the sign-magnitude bit patterns onto a monotonic integer line on
+    // which -0 and +0 are one apart, so a lost sign of zero is a mismatch
+    if (ia < 0) ia = -(ia & INT64_MAX) - 1;
+    if (ib < 0) ib = -(ib & INT64_MAX) - 1;
+
+    return ia > ib ? (uint64_t)ia - (uint64_t)ib : (uint64_t)ib - (uint64_t)ia;
+}
+
+// evaluates `count` random expressions, each for a set of rows of x, y and
+// z, with every backend (including a round trip through reverse Polish
+// notation) and checks them against Parser::parse. Every backend
+// is meant to be bit-exact, so no ULP difference is allowed. The throughput
+// of each backend is compared with `baseline_path`, or recorded there if it
+// does not exist yet. Returns false on a mismatch or a regression.
+static bool
+run_differential(size_t count, char const* baseline_path, Limits const& limits) {
+    static constexpr size_t rows = 16;
+    static constexpr uint64_t max_ulps = 0;
+    static constexpr double regression_threshold = 0.8;
+
+    std::mt19937_64 random(1);
+
+    std::vector<std::string> expressions(count);
+    for (auto& expression : expressions) {
+        random_expression(random, 6, expression);
     }
 
-    double compute_op(Token t, double lhs, double rhs) {
-        switch (t.type) {
-            case TokenType::ADD: return lhs + rhs;
-            case TokenType::SUBTRACT: return lhs - rhs;
-            case TokenType::MULTIPLY: return lhs * rhs;
-            case TokenType::DIVIDE: return lhs / rhs;
-            case TokenType::POWER: return pow(lhs, rhs);
-            default: report_error("Unknown operator:\n");
-        }
+    std::vector<double> columns[3];
+    for (auto& column : columns) {
+        for (size_t row = 0; row < rows; row++) column.push_back((double)(random() % 2000) / 8 - 125);
     }
 
-    double compute_atom() {
-        next_token();
-        if (token.type == TokenType::LEFT_PAREN) {
-            double val = compute_expr(1);
+    // `run(expression, out)` writes the value of expression for every row
+    struct Backend {
+        char const* name;
+        std::function<void(std::string const&, double*)> run;
+        double seconds = 0;
+    };
+
+    auto column_of = [&](SymbolTable const& symbols, uint32_t slot) -> std::vector<double> const& {
+        return columns[symbols.names[slot][0] - 'x'];
+    };
 
-            if (token.type != TokenType::RIGHT_PAREN) report_error("Unmatched '(':\n");
+    auto compiled = [&](Engine engine) {
+        return [&, engine](std::string const& expression, double* out) {
+            SymbolTable symbols;
+            Program program = compile(engine, Lexer(expression), symbols, limits);
+            for (size_t row = 0; row < rows; row++) {
+                out[row] = evaluate(program, [&](uint32_t slot) { return column_of(symbols, slot)[row]; });
+            }
+        };
+    };
 
-            next_token();
-            return val;
+    std::vector<Backend> backends;
+
+    backends.push_back(Backend{ "parse", [&](std::string const& expression, double* out) {
+        for (size_t row = 0; row < rows; row++) {
+            Parser parser{ Lexer(expression) };
+            parser.limits = limits;
+            parser.resolve_variable = [&](std::string_view name, double& value) {
+                value = columns[name[0] - 'x'][row];
+                return true;
+            };
+            out[row] = parser.parse();
         }
+    } });
+
+    backends.push_back(Backend{ "climbing", compiled(Engine::CLIMBING) });
+    backends.push_back(Backend{ "shunting-yard", compiled(Engine::SHUNTING_YARD) });
+    backends.push_back(Backend{ "pratt", compiled(Engine::PRATT) });
+
+    backends.push_back(Backend{ "rpn", [&](std::string const& expression, double* out) {
+        SymbolTable symbols;
+        std::string rpn = to_rpn(compile(Engine::CLIMBING, Lexer(expression), symbols, limits), symbols);
+        for (size_t row = 0; row < rows; row++) {
+            RpnParser parser{ Lexer(rpn) };
+            parser.limits = limits;
+            parser.resolve_variable = [&](std::string_view name, double& value) {
+                value = columns[name[0] - 'x'][row];
+                return true;
+            };
+            out[row] = parser.parse();
+        }
+    } });
+
+    backends.push_back(Backend{ "encoded", [&](std::string const& expression, double* out) {
+        SymbolTable symbols;
+        std::string encoded = encode_program(compile(Engine::CLIMBING, Lexer(expression), symbols, limits), symbols);
 
-        if (token.type == TokenType::END_OF_FILE) {
-            report_error("Unexpected end of expression: \n");
+        EncodedProgram reader;
+        reader.open(encoded.data(), encoded.size());
+        for (size_t row = 0; row < rows; row++) {
+            out[row] = reader.evaluate([&](uint32_t name) { return columns[reader.names[name][0] - 'x'][row]; });
         }
+    } });
 
-        if (token.type != TokenType::NUMBER) {
-            report_error("Unexpected character: \n");
+    backends.push_back(Backend{ "optimized", [&](std::string const& expression, double* out) {
+        SymbolTable symbols;
+        Program program = optimize(compile(Engine::CLIMBING, Lexer(expression), symbols, limits));
+        for (size_t row = 0; row < rows; row++) {
+            out[row] = evaluate(program, [&](uint32_t slot) { return column_of(symbols, slot)[row]; });
+        }
+    } });
+
+    backends.push_back(Backend{ "specialized", [&](std::string const& expression, double* out) {
+        SymbolTable symbols;
+        Program program = compile(Engine::CLIMBING, Lexer(expression), symbols, limits);
+        for (size_t row = 0; row < rows; row++) {
+            std::unordered_map<uint32_t, double> bindings;
+            for (uint32_t slot = 0; slot < symbols.names.size(); slot++) {
+                bindings[slot] = column_of(symbols, slot)[row];
+            }
+            out[row] = evaluate(specialize(program, bindings), [](uint32_t) { return 0.0; });
+        }
+    } });
+
+    backends.push_back(Backend{ "columnar", [&](std::string const& expression, double* out) {
+        SymbolTable symbols;
+        Program program = compile(Engine::CLIMBING, Lexer(expression), symbols, limits);
+        std::vector<double> stack;
+        evaluate_columns(program, rows, [&](Instruction instruction) {
+            return column_of(symbols, instruction.operand).data();
+        }, stack, out);
+    } });
+
+    double expected[rows];
+    double actual[rows];
+    bool ok = true;
+
+    for (auto const& expression : expressions) {
+        for (auto& backend : backends) {
+            auto start = std::chrono::steady_clock::now();
+            backend.run(expression, &backend == &backends[0] ? expected : actual);
+            backend.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            if (&backend == &backends[0]) continue;
+
+            for (size_t row = 0; row < rows; row++) {
+                if (ulp_distance(expected[row], actual[row]) > max_ulps) {
+                    printf("%s disagrees with parse on %s with x = %.17g, y = %.17g, z = %.17g: %.17g instead of %.17g\n",
+                        backend.name, expression.c_str(), columns[0][row], columns[1][row], columns[2][row],
+                        actual[row], expected[row]);
+                    ok = false;
+                    break;
+                }
+            }
         }
+    }
 
-        double val = std::strtod(token.string.data(), nullptr);
-        next_token();
-        return val;
+    std::unordered_map<std::string, double> baseline;
+    FILE* f = baseline_path ? fopen(baseline_path, "r") : nullptr;
+    if (f) {
+        char name[64];
+        double throughput;
+        while (fscanf(f, "%63s %lf", name, &throughput) == 2) {
+            baseline[name] = throughput;
+        }
+        fclose(f);
     }
 
-    double compute_expr(int minimum_precedence) {
-        auto atom_lhs = compute_atom();
+    for (auto const& backend : backends) {
+        double throughput = (double)count / backend.seconds;
+        printf("%-14s %12.0f expressions/s", backend.name, throughput);
 
-        while (true) {
-            auto cur = token;
-            if ((cur.type > TokenType::POWER || cur.type < TokenType::ADD)
-                || OperatorMap[cur.type].prec < minimum_precedence) {
+        auto recorded = baseline.find(backend.name);
+        if (recorded != baseline.end()) {
+            printf("  (baseline %.0f)", recorded->second);
+            if (throughput < recorded->second * regression_threshold) {
+                printf("  regressed");
+                ok = false;
+            }
+        }
+        printf("\n");
+    }
 
-                if (cur.type == TokenType::ILLEGAL_CHARACTER) {
-                    report_error("Unknown operator:\n");
-                }
+    if (baseline_path && !f) {
+        f = fopen(baseline_path, "w");
+        if (!f) {
+            fprintf(stderr, "cannot write %s\n", baseline_path);
+            return false;
+        }
+        for (auto const& backend : backends) {
+            fprintf(f, "%s %.0f\n", backend.name, (double)count / backend.seconds);
+        }
+        fclose(f);
+    }
 
-                break;
-            }
+    return ok;
+}
 
-            auto op_prec = OperatorMap[cur.type];
+// `--self-test`: checks of guarantees that comparing results can't see.
+// Every check prints its name and "ok" or what went wrong.
+struct SelfTest {
+    size_t failures = 0;
 
-            auto next_min_prec =
-                op_prec.assoc == Associativity::LEFT ? op_prec.prec + 1 : op_prec.prec;
+    void expect(char const* name, bool passed, std::string const& detail = "") {
+        printf("%-40s %s%s\n", name, passed ? "ok" : "FAILED ", passed ? "" : detail.c_str());
+        failures += passed ? 0 : 1;
+    }
+};
 
-            auto atom_rhs = compute_expr(next_min_prec);
-            atom_lhs = compute_op(cur, atom_lhs, atom_rhs);
-        }
+// once every buffer has grown to size, evaluating the same expressions again
+// must not allocate: in the REPL's parser, in whole REPL lines with every
+// engine, in the batch loop over repeated lines, and in the compiled, columnar
+// and encoded evaluators that the C API and other processes use
+static void
+test_steady_state_allocations(SelfTest& test, Limits const& limits) {
+    static char const* const expressions[] = {
+        "1 + 2 * 3", "(4 + 5) * (6 - 7) / 8", "2 ** 3 ** 2", "x * y + z", "((x + 1) * (y - 2)) ** 2 / (z + 3)",
+        "a_name_longer_than_the_small_string_buffer - x",
+    };
+    static constexpr int rounds = 1000;
+
+    FormulaGraph formulas;
+    formulas.limits = limits;
+    formulas.define("x", Lexer("3"));
+    formulas.define("y", Lexer("x * 2"));
+    formulas.define("z", Lexer("y - x"));
+    formulas.define("a_name_longer_than_the_small_string_buffer", Lexer("z + 1"));
+
+    auto count = [](auto&& work) {
+        work();
+        size_t before = allocation_count;
+        for (int i = 0; i < rounds; i++) work();
+        return allocation_count - before;
+    };
+
+    double sink = 0;
 
-        return atom_lhs;
+    size_t parser = count([&]() {
+        for (char const* expression : expressions) {
+            Parser parser{ Lexer(expression) };
+            parser.limits = limits;
+            parser.resolve_variable = [&formulas](std::string_view name, double& value) {
+                return formulas.lookup(name, value);
+            };
+            sink += parser.parse();
+        }
+    });
+    test.expect("allocations: REPL parser", parser == 0, std::to_string(parser) + " allocations");
+
+    std::vector<Program> programs;
+    std::vector<std::string> encoded;
+    for (char const* expression : expressions) {
+        programs.push_back(optimize(compile(Engine::CLIMBING, Lexer(expression), formulas.symbols, limits)));
+        encoded.push_back(encode_program(programs.back(), formulas.symbols));
     }
 
-    // error handling
-    void report_error(std::string err) {
-        auto error = err + show_error_location();
-        throw ParserException(error);
+    auto variable = [&formulas](uint32_t slot) {
+        return formulas.value(slot);
+    };
+
+    size_t compiled = count([&]() {
+        for (auto const& program : programs) sink += evaluate(program, variable, limits.max_instructions);
+    });
+    test.expect("allocations: compiled evaluation", compiled == 0, std::to_string(compiled) + " allocations");
+
+    std::vector<double> column(64, 1.5);
+    std::vector<double> stack;
+    std::vector<double> results(column.size());
+    size_t columnar = count([&]() {
+        for (auto const& program : programs) {
+            evaluate_columns(program, column.size(), [&column](Instruction) {
+                return column.data();
+            }, stack, results.data());
+            sink += results[0];
+        }
+    });
+    test.expect("allocations: columnar evaluation", columnar == 0, std::to_string(columnar) + " allocations");
+
+    std::vector<EncodedProgram> opened(encoded.size());
+    for (size_t i = 0; i < encoded.size(); i++) opened[i].open(encoded[i].data(), encoded[i].size());
+    size_t decoded = count([&]() {
+        for (auto const& program : opened) sink += program.evaluate([](uint32_t) { return 2.0; });
+    });
+    test.expect("allocations: encoded evaluation", decoded == 0, std::to_string(decoded) + " allocations");
+
+#ifdef _WIN32
+    int null = _open("NUL", _O_WRONLY);
+#else
+    int null = open("/dev/null", O_WRONLY);
+#endif
+
+    // whole REPL lines, with every engine
+    std::vector<std::string> infix(std::begin(expressions), std::end(expressions));
+    std::vector<std::string> rpn = { "1 2 3 * +", "4 5 + 6 7 - * 8 /", "x y * z +", "a_name_longer_than_the_small_string_buffer x -" };
+    std::pair<char const*, Engine> engines[] = {
+        { "allocations: REPL lines, climbing", Engine::CLIMBING },
+        { "allocations: REPL lines, shunting-yard", Engine::SHUNTING_YARD },
+        { "allocations: REPL lines, pratt", Engine::PRATT },
+        { "allocations: REPL lines, rpn", Engine::RPN },
+    };
+
+    for (auto const& [name, engine] : engines) {
+        Console console(null);
+        formulas.engine = engine;
+        size_t repl = count([&, engine = engine]() {
+            for (auto const& line : engine == Engine::RPN ? rpn : infix) run_line(formulas, console, line);
+        });
+        test.expect(name, repl == 0, std::to_string(repl) + " allocations");
     }
+    formulas.engine = Engine::CLIMBING;
+
+    // the batch loop over lines it has seen before: a run over the input
+    // twice must allocate no more than a run over it once
+    std::string once;
+    for (char const* expression : expressions) {
+        if (strchr(expression, 'x')) continue;
+        once += expression;
+        once += '\n';
+    }
+    std::string twice = once + once;
+
+    BatchJob job;
+    job.limits = limits;
+
+    auto batch = [&](std::string const& input) {
+        size_t before = allocation_count;
+        LineReader in(input.data(), input.size(), 0);
+        LineWriter out(null);
+        run_batch(in, out, job);
+        return allocation_count - before;
+    };
+    size_t repeated = batch(twice) - batch(once);
+    close_file(null);
+    test.expect("allocations: batch lines seen before", repeated == 0, std::to_string(repeated) + " allocations");
+
+    keep(sink);
+}
+
+// open() must reject operands that don't fit in 32 bits or take more than
+// the 5 bytes such a value needs, which evaluate() could not decode safely
+static void
+test_encoded_varints(SelfTest& test) {
+    SymbolTable symbols;
+    std::string valid = encode_program(compile(Engine::CLIMBING, Lexer("x"), symbols, Limits()), symbols);
+
+    // the program ends with its one operand, slot 0
+    std::string prefix = valid.substr(0, valid.size() - 1);
+
+    auto opens = [](std::string const& encoded) {
+        try {
+            EncodedProgram program;
+            program.open(encoded.data(), encoded.size());
+            return true;
+        } catch (EvaluationException&) {
+            return false;
+        }
+    };
+
+    test.expect("encoding: one-byte operand", opens(valid));
+    test.expect("encoding: padded operand within 5 bytes", opens(prefix + std::string("\x80\x80\x80\x80\x00", 5)));
+    test.expect("encoding: operand longer than 5 bytes", !opens(prefix + std::string("\x80\x80\x80\x80\x80\x00", 6)));
+    test.expect("encoding: operand above 32 bits", !opens(prefix + "\x80\x80\x80\x80\x10"));
+}
+
+// the differential harness's comparison must see a lost sign of zero, which
+// is what folding `x * 0` or `0 - x` gets wrong
+static void
+test_ulp_distance(SelfTest& test) {
+    test.expect("differential: same bits", ulp_distance(1.5, 1.5) == 0);
+    test.expect("differential: NaN equals NaN", ulp_distance(std::nan(""), -std::nan("")) == 0);
+    test.expect("differential: -0 differs from +0", ulp_distance(-0.0, 0.0) == 1);
+    test.expect("differential: neighbours across zero", ulp_distance(-std::numeric_limits<double>::denorm_min(), std::numeric_limits<double>::denorm_min()) == 3);
+    test.expect("differential: neighbours", ulp_distance(1.0, std::nextafter(1.0, 2.0)) == 1);
+}
+
+// a NaN or infinity in a rolling window affects the window only while it is
+// in it
+static void
+test_rolling_windows(SelfTest& test) {
+    double const inf = std::numeric_limits<double>::infinity();
+    double const x[] = { 1, NAN, 2, 3, inf, 4, 5, -inf, 6, 7 };
+
+    auto run = [&](char const* expression) {
+        SymbolTable symbols;
+        SeriesEvaluator evaluator(optimize(compile(Engine::CLIMBING, Lexer(expression), symbols, Limits())), 1);
+
+        std::string results;
+        for (double const& value : x) {
+            double const* columns[] = { &value };
+            double result;
+            evaluator.step(columns, &result);
+
+            char buffer[32];
+            snprintf(buffer, sizeof(buffer), "%s%g", results.empty() ? "" : " ", std::isnan(result) ? NAN : result);
+            results += buffer;
+        }
+        return results;
+    };
 
-    // append the location of the parser error
-    std::string show_error_location() {
+    std::string sum = run("sum(x, 2)");
+    test.expect("series: non-finite values leave sums", sum == "1 nan nan 5 inf inf 9 -inf -inf 13", sum);
 
-        char const* const source_start = &lexer.source[0];
+    std::string mean = run("mean(x, 2)");
+    test.expect("series: non-finite values leave means", mean == "1 nan nan 2.5 inf inf 4.5 -inf -inf 6.5", mean);
 
-        char const* start_of_line = token.string.data();
-        while (*start_of_line != '\n' && start_of_line > source_start) {
-            start_of_line--;
+    // the history a window keeps is allocated up front, so its length is capped
+    auto rejected = [](char const* expression, size_t max_window) {
+        SymbolTable symbols;
+        Limits limits;
+        limits.max_window = max_window;
+        try {
+            compile(Engine::CLIMBING, Lexer(expression), symbols, limits);
+            return false;
+        } catch (Parser::ParserException&) {
+            return true;
         }
+    };
+    test.expect("series: overlong lag rejected", rejected("x[t-4000000000]", Limits().max_window));
+    test.expect("series: overlong window rejected", rejected("sum(x, 4294967295)", Limits().max_window));
+    test.expect("series: window at the limit accepted", !rejected("mean(x, 10) + x[t-10]", 10));
+    test.expect("series: window over the limit rejected", rejected("mean(x, 11)", 10));
+}
+
+// every infix engine rejects exactly the expressions the climbing parser
+// rejects as too deeply nested, whatever the depth limit
+static void
+test_depth_limits(SelfTest& test) {
+    static char const* const expressions[] = {
+        "1 + 2 + 3 + 4 + 5 + 6", "((1))", "(((1)))", "2 ** 2 ** 2", "2 ** 2 ** 2 ** 2", "1 + 2 * 3 ** 4",
+        "(1 + (2 * (3 - 4))) ** 2", "1 * 2 + 3 * 4 - 5 / 6",
+    };
 
-        if (*start_of_line == '\0') {
-            start_of_line++;
+    auto nests_too_deeply = [](Engine engine, char const* expression, size_t depth) {
+        SymbolTable symbols;
+        Limits limits;
+        limits.max_depth = depth;
+
+        try {
+            compile(engine, Lexer(expression), symbols, limits);
+            return false;
+        } catch (Parser::ParserException&) {
+            return true;
         }
+    };
 
-        char const* end_of_line = start_of_line;
-        while (*end_of_line != '\n' && *end_of_line != '\0') {
-            end_of_line++;
+    for (Engine engine : { Engine::SHUNTING_YARD, Engine::PRATT }) {
+        std::string differs;
+        for (size_t depth = 1; depth <= 6; depth++) {
+            for (char const* expression : expressions) {
+                if (nests_too_deeply(engine, expression, depth) != nests_too_deeply(Engine::CLIMBING, expression, depth)) {
+                    differs += " '" + std::string(expression) + "' at " + std::to_string(depth);
+                }
+            }
         }
+        test.expect(engine == Engine::PRATT ? "depth: pratt agrees with climbing" : "depth: shunting-yard agrees with climbing",
+            differs.empty(), differs);
+    }
+}
+
+// profiling every engine rebuilds the same subexpressions, parentheses
+// included, and writes them as folded stacks from the whole expression down
+static void
+test_profile_stacks(SelfTest& test) {
+    static char const* const infix = "(x + (2 * 3)) ** 2 - ((4))";
+    static char const* const infix_stacks =
+        "(x + (2 * 3)) ** 2 - ((4));(x + (2 * 3)) ** 2;(x + (2 * 3));x\n"
+        "(x + (2 * 3)) ** 2 - ((4));(x + (2 * 3)) ** 2;(x + (2 * 3));(2 * 3);2\n"
+        "(x + (2 * 3)) ** 2 - ((4));(x + (2 * 3)) ** 2;(x + (2 * 3));(2 * 3);3\n"
+        "(x + (2 * 3)) ** 2 - ((4));(x + (2 * 3)) ** 2;(x + (2 * 3));(2 * 3)\n"
+        "(x + (2 * 3)) ** 2 - ((4));(x + (2 * 3)) ** 2;(x + (2 * 3))\n"
+        "(x + (2 * 3)) ** 2 - ((4));(x + (2 * 3)) ** 2;2\n"
+        "(x + (2 * 3)) ** 2 - ((4));(x + (2 * 3)) ** 2\n"
+        "(x + (2 * 3)) ** 2 - ((4));((4))\n"
+        "(x + (2 * 3)) ** 2 - ((4))\n";
+
+    static char const* const rpn = "x 2 3 * + 2 ** 4 -";
+    static char const* const rpn_stacks =
+        "x 2 3 * + 2 ** 4 -;x 2 3 * + 2 **;x 2 3 * +;x\n"
+        "x 2 3 * + 2 ** 4 -;x 2 3 * + 2 **;x 2 3 * +;2 3 *;2\n"
+        "x 2 3 * + 2 ** 4 -;x 2 3 * + 2 **;x 2 3 * +;2 3 *;3\n"
+        "x 2 3 * + 2 ** 4 -;x 2 3 * + 2 **;x 2 3 * +;2 3 *\n"
+        "x 2 3 * + 2 ** 4 -;x 2 3 * + 2 **;x 2 3 * +\n"
+        "x 2 3 * + 2 ** 4 -;x 2 3 * + 2 **;2\n"
+        "x 2 3 * + 2 ** 4 -;x 2 3 * + 2 **\n"
+        "x 2 3 * + 2 ** 4 -;4\n"
+        "x 2 3 * + 2 ** 4 -\n";
+
+    std::pair<char const*, Engine> engines[] = {
+        { "climbing", Engine::CLIMBING },
+        { "shunting-yard", Engine::SHUNTING_YARD },
+        { "pratt", Engine::PRATT },
+        { "rpn", Engine::RPN },
+    };
 
-        if (*(end_of_line - 1) == '\r') {
-            end_of_line--;
+    for (auto const& [name, engine] : engines) {
+        char const* source = engine == Engine::RPN ? rpn : infix;
+
+        SymbolTable symbols;
+        std::vector<SourceSpan> spans;
+        Program program = compile(engine, Lexer(source), symbols, Limits(), &spans);
+
+        Profile found = profile(program, spans, source, [](uint32_t) { return 1.0; }, 0);
+
+        // the times differ from run to run, the stacks must not
+        std::string stacks = folded_stacks(found, source);
+        std::string frames;
+        for (size_t begin = 0, end; (end = stacks.find('\n', begin)) != std::string::npos; begin = end + 1) {
+            frames.append(stacks, begin, stacks.rfind(' ', end) - begin);
+            frames += '\n';
         }
 
-        size_t source_line_len = end_of_line - start_of_line;
+        std::string title = std::string("profile: ") + name + " folded stacks";
+        test.expect(title.c_str(), frames == (engine == Engine::RPN ? rpn_stacks : infix_stacks), frames);
+    }
+}
+
+// runs every check; false if any failed
+static bool
+run_self_test(Limits const& limits) {
+    SelfTest test;
+
+    test_steady_state_allocations(test, limits);
+    test_encoded_varints(test);
+    test_ulp_distance(test);
+    test_rolling_windows(test);
+    test_depth_limits(test);
+    test_profile_stacks(test);
+
+    printf("%zu failed\n", test.failures);
+    return test.failures == 0;
+}
+
+struct Options {
+    char const* batch_input = nullptr;
+    char const* batch_output = nullptr;
+    char const* cache_path = nullptr;
+    size_t workers = 0;
+    char const* checkpoint_path = nullptr;
+    bool numa = false;
+    bool huge_pages = false;
+    bool count_allocations = false;
+    bool check = false;
+    bool emit_rpn = false;
+    char const* engine = nullptr;
+    bool benchmark = false;
+    size_t differential = 0;
+    char const* baseline_path = nullptr;
+    bool self_test = false;
+};
 
-        size_t space_before_caret = token.string.data() - start_of_line;
+// a count given on the command line: all digits, at least 1 and in range
+static bool
+parse_count(char const* text, size_t& count) {
+    if (*text < '0' || *text > '9') return false;
 
-        size_t total_length = source_line_len + space_before_caret + 3;
+    char* end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (*end != '\0' || errno == ERANGE || value < 1 || value > SIZE_MAX) return false;
 
-        std::string error_str;
+    count = (size_t)value;
+    return true;
+}
 
-        size_t offset = 0;
-        while (source_line_len--) {
-            error_str += source_start[offset++];
+static bool
+parse_options(int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            options.batch_input = argv[++i];
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                options.batch_output = argv[++i];
+            }
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            options.cache_path = argv[++i];
+        } else if (strcmp(argv[i], "--differential") == 0 && i + 1 < argc) {
+            if (!parse_count(argv[++i], options.differential)) return false;
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            options.baseline_path = argv[++i];
+        } else if (strcmp(argv[i], "--benchmark") == 0) {
+            options.benchmark = true;
+        } else if (strcmp(argv[i], "--self-test") == 0) {
+            options.self_test = true;
+        } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            options.engine = argv[++i];
+        } else if (strcmp(argv[i], "--emit-rpn") == 0) {
+            options.emit_rpn = true;
+        } else if (strcmp(argv[i], "--check") == 0) {
+            options.check = true;
+        } else if (strcmp(argv[i], "--count-allocations") == 0) {
+            options.count_allocations = true;
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            options.checkpoint_path = argv[++i];
+        } else if (strcmp(argv[i], "--huge-pages") == 0) {
+            options.huge_pages = true;
+        } else if (strcmp(argv[i], "--numa") == 0) {
+            options.numa = true;
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            if (!parse_count(argv[++i], options.workers)) return false;
+        } else {
+            return false;
         }
+    }
+
+    return true;
+}
+
+static bool
+run_batch_job(Options const& options, Limits const& limits) {
+#ifdef _WIN32
+    int in = _open(options.batch_input, _O_RDONLY | _O_BINARY);
+#else
+    int in = open(options.batch_input, O_RDONLY);
+#endif
+    if (in < 0) {
+        fprintf(stderr, "cannot open %s\n", options.batch_input);
+        return false;
+    }
+
+    BatchJob job;
+    job.limits = limits;
+    job.huge_pages = options.huge_pages;
+    job.count_allocations = options.count_allocations;
+    job.check = options.check;
+    job.emit_rpn = options.emit_rpn;
+
+    if (options.engine && !parse_engine(options.engine, job.engine)) {
+        fprintf(stderr, "unknown engine %s\n", options.engine);
+        return false;
+    }
+
+    Checkpoint checkpoint;
+    checkpoint.path = options.checkpoint_path;
+
+    if (checkpoint.path && !checkpoint.describe(options.batch_input)) {
+        fprintf(stderr, "cannot read %s\n", options.batch_input);
+        return false;
+    }
+
+    // resuming drops any output written after the last checkpoint
+    bool other_input = false;
+    bool resume = checkpoint.path && checkpoint.load(other_input);
+
+    if (other_input) {
+        fprintf(stderr, "checkpoint %s was not taken of %s as it is now\n", checkpoint.path, options.batch_input);
+        return false;
+    }
+
+    int out = 1;
+    if (options.batch_output) {
+#ifdef _WIN32
+        out = _open(options.batch_output, _O_WRONLY | _O_CREAT | _O_BINARY | (resume ? 0 : _O_TRUNC), _S_IREAD | _S_IWRITE);
+#else
+        out = open(options.batch_output, O_WRONLY | O_CREAT | (resume ? 0 : O_TRUNC), 0644);
+#endif
+    }
+
+    if (out < 0) {
+        fprintf(stderr, "cannot open %s\n", options.batch_output);
+        return false;
+    }
 
-        error_str += '\n';
+    if (resume) {
+#ifndef _WIN32
+        // an output shorter than the checkpoint says was lost or replaced, and
+        // truncating would pad it with zeros instead of the missing results
+        struct stat st;
+        if (fstat(out, &st) != 0 || st.st_size < (off_t)checkpoint.output_offset) {
+            fprintf(stderr, "%s is shorter than checkpoint %s recorded\n", options.batch_output, checkpoint.path);
+            return false;
+        }
 
-        while (space_before_caret--) {
-            error_str += ' ';
+        if (ftruncate(out, (off_t)checkpoint.output_offset) != 0) {
+            fprintf(stderr, "cannot truncate %s\n", options.batch_output);
+            return false;
         }
+#endif
+        seek_file(out, 0, SEEK_END);
+    }
 
-        error_str += '^';
+    long long start = resume ? checkpoint.input_offset : 0;
 
-        return error_str;
+    SharedResultCache shared;
+    if (options.cache_path && !shared.open(options.cache_path)) {
+        fprintf(stderr, "cannot open result cache %s\n", options.cache_path);
+        return false;
     }
 
-    struct ParserException : public std::exception {
+    job.shared = options.cache_path ? &shared : nullptr;
+    job.checkpoint = checkpoint.path ? &checkpoint : nullptr;
 
-        std::string error;
+    bool ok;
 
-        ParserException(std::string err) : error(err) {
+#ifndef _WIN32
+    LargeBuffer output_buffer;
+    bool huge_output = job.huge_pages && output_buffer.allocate(LargeBuffer::huge_page_size, true);
+    LineWriter writer(out, huge_output ? output_buffer.data : nullptr, LargeBuffer::huge_page_size);
+#else
+    LineWriter writer(out);
+#endif
+
+#ifndef _WIN32
+    if (options.workers > 0) {
+        NumaTopology numa;
+        if (options.numa) {
+            numa.discover();
         }
 
-        const char* what() const throw() {
-            return error.c_str();
+        ok = run_sharded_batch(options.batch_input, writer, options.workers, job, options.numa ? &numa : nullptr);
+
+    } else if (job.huge_pages) {
+        // read the whole remaining input into huge-page backed memory
+        int fd = open(options.batch_input, O_RDONLY);
+        struct stat st;
+        LargeBuffer input;
+
+        size_t size = fd >= 0 && fstat(fd, &st) == 0 && st.st_size > start ? (size_t)(st.st_size - start) : 0;
+        ok = fd >= 0 && input.allocate(size, true) && input.read(fd, (off_t)start, size);
+
+        if (fd >= 0) close(fd);
+
+        if (ok) {
+            LineReader memory(input.data, size, start);
+            ok = run_batch(memory, writer, job);
         }
-    };
-};
 
-int main()
+    } else
+#endif
+    {
+        seek_file(in, start, SEEK_SET);
+        LineReader reader(in, start);
+        ok = run_batch(reader, writer, job);
+    }
+
+    ok = writer.flush() && ok;
+    close_file(in);
+    if (out != 1) {
+        ok = close_file(out) == 0 && ok;
+    }
+
+    if (ok && job.checkpoint) {
+        checkpoint.remove();
+    }
+
+    return ok;
+}
+
+int main(int argc, char** argv)
 {
     std::string s;
 
-    char buffer[64] = {0};
+    FormulaGraph formulas;
 
-    for (;;) {
-        printf("> ");
-        std::getline(std::cin, s);
+    Options options;
+    if (!parse_options(argc, argv, options)
+        || ((options.cache_path || options.workers || options.checkpoint_path || options.huge_pages || options.count_allocations || options.check || options.emit_rpn || options.engine) && !options.batch_input)
+        || ((options.check || options.emit_rpn) && options.cache_path)
+        || (options.numa && !options.workers)
+        || (options.baseline_path && !options.differential)) {
+        fprintf(stderr, "usage: %s [--batch <input> [output] [--cache <path>] [--workers <n> [--numa]] [--checkpoint <path>] [--huge-pages] [--count-allocations] [--check] [--emit-rpn] [--engine <engine>]] [--benchmark] [--differential <n> [--baseline <path>]] [--self-test]\n", argv[0]);
+        return 1;
+    }
+
+    if (options.checkpoint_path && !options.batch_output) {
+        fprintf(stderr, "--checkpoint needs an output file\n");
+        return 1;
+    }
+
+#ifdef _WIN32
+    // workers are forked processes, placed on nodes with Linux calls
+    if (options.workers || options.numa) {
+        fprintf(stderr, "--workers and --numa are only supported on POSIX systems\n");
+        return 1;
+    }
+#endif
 
-        if (s == ":quit") {
+    if (options.benchmark) {
+        run_benchmark(formulas.limits);
+        return 0;
+    }
+
+    if (options.self_test) {
+        return run_self_test(formulas.limits) ? 0 : 1;
+    }
+
+    if (options.differential) {
+        return run_differential(options.differential, options.baseline_path, formulas.limits) ? 0 : 1;
+    }
+
+    if (options.batch_input) {
+        return run_batch_job(options, formulas.limits) ? 0 : 1;
+    }
+
+    Console console;
+    bool count_allocations = false;
+
+    for (;;) {
+        if (!console.read_line("> ", s) || s == ":quit") {
             break;
         }
 
-        Lexer lexer(s);
-        Parser parser(lexer);
+        if (s == ":allocations") {
+            count_allocations = !count_allocations;
+            continue;
+        }
 
-        try {
-            auto value = parser.parse();
-            snprintf(buffer, sizeof(buffer), "%g", value);
-            printf(" = %s\n", buffer);
+        size_t allocations = allocation_count;
 
-        } catch (Parser::ParserException& e) {
-            printf("%s\n", e.what());
+        run_line(formulas, console, s);
+
+        if (count_allocations) {
+            console.print(" (%zu allocations)\n", allocation_count - allocations);
         }
     }
 }
@@ -0,0 +1,22 @@
+# runs PROGRAM --batch INPUT OUTPUT with any extra ARGS (a ';' list) and
+# fails unless OUTPUT matches EXPECTED exactly
+#
+#   cmake -D PROGRAM=... -D INPUT=... -D EXPECTED=... -D OUTPUT=... [-D ARGS=...] -P run_batch.cmake
+
+file(REMOVE ${OUTPUT})
+
+execute_process(
+    COMMAND ${PROGRAM} --batch ${INPUT} ${OUTPUT} ${ARGS}
+    RESULT_VARIABLE result)
+
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "batch run failed: ${result}")
+endif()
+
+execute_process(
+    COMMAND ${CMAKE_COMMAND} -E compare_files ${OUTPUT} ${EXPECTED}
+    RESULT_VARIABLE different)
+
+if(different)
+    message(FATAL_ERROR "${OUTPUT} differs from ${EXPECTED}")
+endif()
@@ -0,0 +1,45 @@
+# runs PROGRAM over INPUTS (a ';' list, concatenated) with each engine in turn,
+# all sharing one --cache file, and fails unless every run matches a run of
+# the same engine without the cache
+#
+#   cmake -D PROGRAM=... -D INPUTS=... -D DIRECTORY=... -P run_cache.cmake
+
+set(input ${DIRECTORY}/cache.txt)
+set(cache ${DIRECTORY}/cache.table)
+
+file(MAKE_DIRECTORY ${DIRECTORY})
+file(REMOVE ${cache})
+
+set(lines "")
+foreach(path ${INPUTS})
+    file(READ ${path} contents)
+    string(APPEND lines "${contents}")
+endforeach()
+file(WRITE ${input} "${lines}")
+
+# rpn both first and last, so each side has values the other could misread
+foreach(engine rpn climbing shunting-yard pratt rpn)
+    set(expected ${DIRECTORY}/cache-${engine}.expected)
+    set(output ${DIRECTORY}/cache-${engine}.out)
+
+    execute_process(
+        COMMAND ${PROGRAM} --batch ${input} ${expected} --engine ${engine}
+        RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "${engine} run failed: ${result}")
+    endif()
+
+    execute_process(
+        COMMAND ${PROGRAM} --batch ${input} ${output} --engine ${engine} --cache ${cache}
+        RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "cached ${engine} run failed: ${result}")
+    endif()
+
+    execute_process(
+        COMMAND ${CMAKE_COMMAND} -E compare_files ${output} ${expected}
+        RESULT_VARIABLE different)
+    if(different)
+        message(FATAL_ERROR "cached ${engine} run differs from an uncached one")
+    endif()
+endforeach()
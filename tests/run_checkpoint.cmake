@@ -0,0 +1,82 @@
+# repeats INPUT into a batch long enough for several checkpoints, kills a
+# checkpointed run of PROGRAM with any extra ARGS (a ';' list) after its
+# first checkpoint, and fails unless:
+#   - resuming on a different input is refused
+#   - resuming with an output shorter than the checkpoint is refused
+#   - resuming on the same input finishes with the output of an
+#     uninterrupted run
+#
+#   cmake -D PROGRAM=... -D INPUT=... -D DIRECTORY=... [-D ARGS=...] -P run_checkpoint.cmake
+
+set(input ${DIRECTORY}/checkpoint.txt)
+set(copy ${DIRECTORY}/checkpoint-copy.txt)
+set(expected ${DIRECTORY}/checkpoint.expected)
+set(output ${DIRECTORY}/checkpoint.out)
+set(checkpoint ${DIRECTORY}/checkpoint.state)
+
+file(MAKE_DIRECTORY ${DIRECTORY})
+file(REMOVE ${output} ${checkpoint})
+
+file(READ ${INPUT} lines)
+# 2^14 copies; string(REPEAT) would need CMake 3.15
+foreach(i RANGE 1 14)
+    string(APPEND lines "${lines}")
+endforeach()
+file(WRITE ${input} "${lines}")
+file(WRITE ${copy} "${lines}")
+
+execute_process(
+    COMMAND ${PROGRAM} --batch ${input} ${expected} ${ARGS}
+    RESULT_VARIABLE result)
+
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "uninterrupted run failed: ${result}")
+endif()
+
+execute_process(
+    COMMAND ${CMAKE_COMMAND} -E env CALCULATOR_CHECKPOINT_CRASH_AFTER=1
+        ${PROGRAM} --batch ${input} ${output} --checkpoint ${checkpoint} ${ARGS}
+    RESULT_VARIABLE result)
+
+if(result EQUAL 0 OR NOT EXISTS ${checkpoint})
+    message(FATAL_ERROR "the run was not killed after a checkpoint: ${result}")
+endif()
+
+execute_process(
+    COMMAND ${PROGRAM} --batch ${copy} ${output} --checkpoint ${checkpoint} ${ARGS}
+    RESULT_VARIABLE result
+    ERROR_QUIET)
+
+if(result EQUAL 0)
+    message(FATAL_ERROR "resumed a checkpoint of another input")
+endif()
+
+file(READ ${output} written)
+file(WRITE ${output} "")
+
+execute_process(
+    COMMAND ${PROGRAM} --batch ${input} ${output} --checkpoint ${checkpoint} ${ARGS}
+    RESULT_VARIABLE result
+    ERROR_QUIET)
+
+if(result EQUAL 0)
+    message(FATAL_ERROR "resumed with an output shorter than the checkpoint")
+endif()
+
+file(WRITE ${output} "${written}")
+
+execute_process(
+    COMMAND ${PROGRAM} --batch ${input} ${output} --checkpoint ${checkpoint} ${ARGS}
+    RESULT_VARIABLE result)
+
+if(NOT result EQUAL 0 OR EXISTS ${checkpoint})
+    message(FATAL_ERROR "resuming failed: ${result}")
+endif()
+
+execute_process(
+    COMMAND ${CMAKE_COMMAND} -E compare_files ${output} ${expected}
+    RESULT_VARIABLE different)
+
+if(different)
+    message(FATAL_ERROR "${output} differs from an uninterrupted run")
+endif()